@@ -0,0 +1,121 @@
+# Microbenchmarks for the two hot paths: recording a sample (driven through
+# :custom mode with generated stacks) and building results from tables of a
+# given frame count and edge density. Writes JSON.
+#
+#   rake bench:micro
+#   DEPTHS=10,200 FRAMES=100,10000 SAMPLES=20000 OUT=micro.json rake bench:micro
+
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprofx'
+require 'json'
+
+def list(name, default)
+  (ENV[name] ? ENV[name].split(',') : default).map(&:to_i)
+end
+
+DEPTHS  = list('DEPTHS', %w[10 50 200 1000])
+FRAMES  = list('FRAMES', %w[10 100 1000 10000])
+LINES   = list('LINES', %w[1 16 256])
+EDGES   = list('EDGES', %w[1 4 16])
+SAMPLES = Integer(ENV['SAMPLES'] || 10_000)
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# A throwaway module with `frames` distinct methods (each its own iseq and
+# file), where method i calls one of `edges` successors until `depth` runs
+# out, and a leaf that samples from one of `lines` lines.
+def synthetic(frames, edges, lines)
+  mod = Module.new
+  rng = Random.new(frames * 31 + edges)
+  succ = Array.new(frames) { Array.new(edges) { rng.rand(frames) } }
+  mod.const_set(:SUCC, succ)
+  mod.const_set(:RNG, rng)
+
+  frames.times do |i|
+    mod.module_eval(<<-RUBY, "synthetic_#{i}.rb", 1)
+      def self.f#{i}(depth)
+        return leaf if depth <= 1
+        send(:"f\#{SUCC[#{i}][RNG.rand(#{edges})]}", depth - 1)
+      end
+    RUBY
+  end
+
+  branches = lines.times.map { |l| "when #{l}\n  StackProfx.sample" }.join("\n")
+  mod.module_eval(<<-RUBY, 'synthetic_leaf.rb', 1)
+    def self.leaf
+      case RNG.rand(#{lines})
+      #{branches}
+      end
+    end
+  RUBY
+  mod
+end
+
+def record(mod, depth, samples, opts)
+  StackProfx.start({ mode: :custom }.merge(opts))
+  started = now
+  samples.times { mod.f0(depth) }
+  elapsed = now - started
+  StackProfx.stop
+  elapsed
+end
+
+def walk_cost(mod, depth, samples)
+  started = now
+  samples.times { mod.f0(depth) }
+  now - started
+end
+
+results = { record: [], results: [] }
+
+# Recording: cost per sample over the cost of producing the same stacks.
+DEPTHS.each do |depth|
+  FRAMES.each do |frames|
+    LINES.each do |lines|
+      [{ raw: false }, { raw: true }, { granularity: :method }].each do |opts|
+        mod = synthetic(frames, 4, lines)
+        base = walk_cost(mod, depth, SAMPLES)
+        elapsed = record(mod, depth, SAMPLES, opts)
+        profile = StackProfx.results
+        rec = {
+          depth: depth, frames: frames, lines: lines, raw: !!opts[:raw],
+          granularity: opts[:granularity] || :line,
+          samples: profile[:samples], recorded_frames: profile[:frames].size,
+          us_per_sample: ((elapsed - base) * 1_000_000 / SAMPLES).round(3),
+        }
+        results[:record] << rec
+        $stderr.puts "record\t#{rec.values.join("\t")}"
+      end
+    end
+  end
+end
+
+# Results building: time to materialize tables of a given size.
+FRAMES.each do |frames|
+  EDGES.each do |edges|
+    [:hash, :profile, :pprof].each do |format|
+      mod = synthetic(frames, edges, 1)
+      record(mod, 50, SAMPLES, raw: true)
+      started = now
+      profile = StackProfx.results(format: format)
+      elapsed = now - started
+      profile = profile.to_h if format == :profile
+      rec = {
+        frames: frames, edges: edges, format: format,
+        recorded_frames: format == :pprof ? nil : profile[:frames].size,
+        ms: (elapsed * 1000).round(3),
+      }
+      results[:results] << rec
+      $stderr.puts "results\t#{rec.values.join("\t")}"
+    end
+  end
+end
+
+json = JSON.pretty_generate(ruby: RUBY_VERSION, samples: SAMPLES, **results)
+if ENV['OUT']
+  File.write(ENV['OUT'], json)
+else
+  puts json
+end
@@ -0,0 +1,121 @@
+# End-to-end profiler overhead: runs a synthetic workload with and without
+# profiling for every combination of mode, raw/aggregate, thread count and
+# stack depth, and writes one JSON record per combination.
+#
+#   rake bench:overhead
+#   MODES=cpu,wall THREADS=1,16 DEPTHS=10,500 DURATION=1 OUT=overhead.json rake bench:overhead
+
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprofx'
+require 'json'
+
+def list(name, default)
+  ENV[name] ? ENV[name].split(',') : default
+end
+
+MODES    = list('MODES', %w[cpu wall object custom]).map(&:to_sym)
+THREADS  = list('THREADS', %w[1 4 16 64 256]).map(&:to_i)
+DEPTHS   = list('DEPTHS', %w[10 100 500 2000]).map(&:to_i)
+STORAGE  = [{ raw: false, aggregate: true }, { raw: true, aggregate: true }, { raw: true, aggregate: false }]
+DURATION = Float(ENV['DURATION'] || 0.5)
+INTERVAL = ENV['INTERVAL'] && Integer(ENV['INTERVAL'])
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def rss_kb
+  File.read('/proc/self/status')[/^VmRSS:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  0
+end
+
+def descend(depth, &block)
+  depth > 1 ? descend(depth - 1, &block) : yield
+end
+
+def leaf
+  s = 0
+  200.times { |i| s += i * i }
+  Object.new
+  s
+end
+
+# Iterations per second of `threads` threads, each calling leaf at `depth`.
+def workload(threads, depth)
+  stop = false
+  counts = Array.new(threads, 0)
+  workers = threads.times.map do |t|
+    Thread.new do
+      descend(depth) do
+        until stop
+          leaf
+          counts[t] += 1
+        end
+      end
+    end
+  end
+  start = now
+  sleep DURATION
+  stop = true
+  workers.each(&:join)
+  counts.inject(:+) / (now - start)
+end
+
+def custom_sampler(interval)
+  Thread.new do
+    loop do
+      StackProfx.sample
+      sleep interval / 1_000_000.0
+    end
+  end
+end
+
+results = []
+
+THREADS.each do |threads|
+  DEPTHS.each do |depth|
+    baseline = workload(threads, depth)
+
+    MODES.each do |mode|
+      STORAGE.each do |storage|
+        opts = { mode: mode }.merge(storage)
+        opts[:interval] = INTERVAL if INTERVAL
+        GC.start
+        rss = rss_kb
+
+        StackProfx.start(opts)
+        sampler = custom_sampler(INTERVAL || 1000) if mode == :custom
+        started = now
+        profiled = workload(threads, depth)
+        elapsed = now - started
+        sampler.kill.join if sampler
+        StackProfx.stop
+        profile = StackProfx.results
+
+        samples = profile[:samples]
+        lost = 1 - profiled / baseline
+        record = {
+          mode: mode, raw: storage[:raw], aggregate: storage[:aggregate],
+          threads: threads, depth: depth,
+          baseline_ips: baseline.round(1), profiled_ips: profiled.round(1),
+          throughput_loss: lost.round(4),
+          samples: samples, missed_samples: profile[:missed_samples],
+          sample_latency_us: samples > 0 ? (lost * elapsed * 1_000_000 / samples).round(2) : nil,
+          frames: profile[:frames].size,
+          rss_kb: rss_kb - rss,
+          results_bytes: Marshal.dump(profile).bytesize,
+        }
+        results << record
+        $stderr.puts record.values_at(:mode, :raw, :aggregate, :threads, :depth, :throughput_loss, :sample_latency_us).join("\t")
+      end
+    end
+  end
+end
+
+json = JSON.pretty_generate(ruby: RUBY_VERSION, duration: DURATION, results: results)
+if ENV['OUT']
+  File.write(ENV['OUT'], json)
+else
+  puts json
+end
@@ -0,0 +1,67 @@
+# Sampling cost as the thread count grows. Every tick walks all living
+# threads, so for each count this spawns mostly idle threads plus a few busy
+# ones, profiles in :wall mode and reads the per-tick cost the extension
+# measures (:sampling_ns / :sample_ticks). Exits non-zero when the cost per
+# thread at the largest count exceeds MAX_GROWTH times the cost per thread at
+# the smallest.
+#
+#   rake bench:threads
+#   THREADS=10,500,2000 BUSY=4 DURATION=2 MAX_GROWTH=3 OUT=threads.json rake bench:threads
+
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprofx'
+require 'json'
+
+THREADS    = (ENV['THREADS'] || '10,100,500,1000').split(',').map(&:to_i).sort
+BUSY       = Integer(ENV['BUSY'] || 4)
+DURATION   = Float(ENV['DURATION'] || 1)
+INTERVAL   = Integer(ENV['INTERVAL'] || 1000)
+MAX_GROWTH = Float(ENV['MAX_GROWTH'] || 3)
+
+def nest(depth, &block)
+  depth > 1 ? nest(depth - 1, &block) : yield
+end
+
+def run(count)
+  busy = [BUSY, count].min
+  stop = false
+  gate = Queue.new
+  threads = (count - busy).times.map { Thread.new { nest(20) { gate.pop } } }
+  threads += busy.times.map { Thread.new { nest(20) { Math.sqrt(rand) until stop } } }
+  sleep 0.1 until threads.count { |t| t.status == 'sleep' } >= count - busy
+
+  profile = StackProfx.run(mode: :wall, interval: INTERVAL) { sleep DURATION }
+
+  stop = true
+  threads.size.times { gate << nil }
+  threads.each(&:join)
+
+  ticks = profile[:sample_ticks]
+  mean = ticks > 0 ? profile[:sampling_ns] / ticks.to_f : 0.0
+  {
+    threads: count + 1, busy: busy, ticks: ticks,
+    expected_ticks: (DURATION * 1_000_000 / INTERVAL).round,
+    missed_samples: profile[:missed_samples],
+    tick_mean_us: (mean / 1000).round(2),
+    tick_max_us: (profile[:sampling_max_ns] / 1000.0).round(2),
+    per_thread_ns: (mean / (count + 1)).round(1),
+  }
+end
+
+results = THREADS.map do |count|
+  run(count).tap { |r| $stderr.puts r.values.join("\t") }
+end
+
+growth = results.last[:per_thread_ns] / results.first[:per_thread_ns]
+json = JSON.pretty_generate(ruby: RUBY_VERSION, duration: DURATION, interval: INTERVAL,
+                            growth: growth.round(2), max_growth: MAX_GROWTH, results: results)
+if ENV['OUT']
+  File.write(ENV['OUT'], json)
+else
+  puts json
+end
+
+if growth > MAX_GROWTH
+  abort "per-thread sampling cost grew #{growth.round(2)}x from #{results.first[:threads]} " \
+        "to #{results.last[:threads]} threads (limit #{MAX_GROWTH}x)"
+end
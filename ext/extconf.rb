@@ -6,6 +6,12 @@ if have_func('rb_postponed_job_register_one') &&
 
   ext_path = File.expand_path '../ruby_headers/215', __FILE__
   $CFLAGS += " -I#{ext_path}"
+  have_library('z', 'deflateInit2_') && have_header('zlib.h')
+  # native: true walks frame pointers and symbolizes with dladdr
+  $CPPFLAGS += " -D_GNU_SOURCE"
+  have_library('dl', 'dladdr')
+  have_func('dladdr', 'dlfcn.h')
+  have_func('dl_iterate_phdr', 'link.h')
   create_makefile('stackprofx')
 else
   fail 'missing API: are you using ruby 2.1+?'
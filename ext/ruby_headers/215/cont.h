@@ -0,0 +1,105 @@
+/**********************************************************************
+
+  cont.h -
+
+  rb_context_t and rb_fiber_t as defined (privately) in cont.c of
+  ruby 2.1.5, so that suspended fibers can be walked.
+
+  Copyright (C) 2007 Koichi Sasada
+
+**********************************************************************/
+
+#ifndef RUBY_CONT_H
+#define RUBY_CONT_H
+
+#include "vm_core.h"
+
+#if !defined(FIBER_USE_NATIVE)
+# if defined(HAVE_GETCONTEXT) && defined(HAVE_SETCONTEXT)
+#   if 0
+#   elif defined(__NetBSD__)
+#     define FIBER_USE_NATIVE 0
+#   elif defined(__sun)
+#     define FIBER_USE_NATIVE 0
+#   elif defined(__ia64)
+#     define FIBER_USE_NATIVE 0
+#   elif defined(__GNU__)
+#     define FIBER_USE_NATIVE 0
+#   else
+#     define FIBER_USE_NATIVE 1
+#   endif
+# elif defined(_WIN32)
+#   define FIBER_USE_NATIVE 1
+# endif
+#endif
+#if !defined(FIBER_USE_NATIVE)
+#define FIBER_USE_NATIVE 0
+#endif
+
+#if FIBER_USE_NATIVE && !defined(_WIN32)
+#include <ucontext.h>
+#endif
+
+#define CAPTURE_JUST_VALID_VM_STACK 1
+
+enum context_type {
+    CONTINUATION_CONTEXT = 0,
+    FIBER_CONTEXT = 1,
+    ROOT_FIBER_CONTEXT = 2
+};
+
+typedef struct rb_context_struct {
+    enum context_type type;
+    VALUE self;
+    int argc;
+    VALUE value;
+    VALUE *vm_stack;
+#ifdef CAPTURE_JUST_VALID_VM_STACK
+    size_t vm_stack_slen;  /* length of stack (head of th->stack) */
+    size_t vm_stack_clen;  /* length of control frames (tail of th->stack) */
+#endif
+    VALUE *machine_stack;
+    VALUE *machine_stack_src;
+#ifdef __ia64
+    VALUE *machine_register_stack;
+    VALUE *machine_register_stack_src;
+    int machine_register_stack_size;
+#endif
+    rb_thread_t saved_thread;
+    rb_jmpbuf_t jmpbuf;
+    rb_ensure_entry_t *ensure_array;
+    rb_ensure_list_t *ensure_list;
+    size_t machine_stack_size;
+} rb_context_t;
+
+enum fiber_status {
+    CREATED,
+    RUNNING,
+    TERMINATED
+};
+
+typedef struct rb_fiber_struct {
+    rb_context_t cont;
+    VALUE prev;
+    enum fiber_status status;
+    struct rb_fiber_struct *prev_fiber;
+    struct rb_fiber_struct *next_fiber;
+    /* If a fiber invokes "transfer",
+     * then this fiber can't "resume" any more after that.
+     * You shouldn't mix "transfer" and "resume".
+     */
+    int transfered;
+
+#if FIBER_USE_NATIVE
+#ifdef _WIN32
+    void *fib_handle;
+#else
+    ucontext_t context;
+#endif
+#endif
+} rb_fiber_t;
+
+/* cont.c wraps fibers with a static data type; the pointer is all we need */
+#define GetFiberPtr(obj, ptr) ((ptr) = (rb_fiber_t *)DATA_PTR(obj))
+
+#endif /* RUBY_CONT_H */
@@ -13,12 +13,30 @@
 #include <ruby/intern.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
 #include <pthread.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && \
+    defined(HAVE_DLADDR) && defined(HAVE_DL_ITERATE_PHDR)
+#define STACKPROFX_NATIVE 1
+#include <dlfcn.h>
+#include <link.h>
+#include <ucontext.h>
+#endif
 
 #define ruby_current_thread ((rb_thread_t *)RTYPEDDATA_DATA(rb_thread_current()))
 
 #include "vm_core.h"
 #include "iseq.h"
+#include "cont.h"
 
 static inline const rb_data_type_t *
 threadptr_data_type(void)
@@ -35,56 +53,397 @@ threadptr_data_type(void)
 #define ruby_threadptr_data_type *threadptr_data_type()
 
 #define BUF_SIZE 2048
+#define NATIVE_MAX 64
+#define FRAME_POOL_SIZE 256
+#define TABLE_POOL_SIZE 256
+#define GROW_QUEUE_SIZE 64
+#define EXTERNAL_SLOTS 64
+#define EXTERNAL_DEPTH 512
+#define TABLE_INIT_BINS 16
+#define FRAMES_INIT_BINS 1024
+#define ST_MAX_DENSITY 5	/* st.c rehashes past this many entries per bin */
+
+/*
+ * Append-only store made of mmap'd chunks. Chunks are never moved or
+ * copied; when the tail is full a new one is mapped. With a backing file
+ * (raw_file:) chunks are MAP_SHARED windows onto it, so the kernel can
+ * write cold pages back instead of keeping them in anonymous memory.
+ */
+#define RAW_CHUNK_SIZE (1024 * 1024)
+
+typedef struct raw_chunk {
+    struct raw_chunk *next;
+    size_t mapped;	/* bytes mapped, header included */
+    size_t len;		/* bytes of data in use */
+    char data[1];
+} raw_chunk_t;
+
+typedef struct {
+    raw_chunk_t *head;
+    raw_chunk_t *tail;
+    size_t len;		/* bytes of data in use, all chunks */
+    size_t mapped;	/* bytes mapped, all chunks */
+    raw_chunk_t *spare;	/* mapped ahead of need by housekeeping */
+} raw_store_t;
+
+typedef struct {
+    raw_chunk_t *chunk;
+    size_t off;
+} raw_iter_t;
+
+/*
+ * shared: true. The segment is mapped MAP_SHARED before workers are forked,
+ * so every process samples into the same open-addressed tables: stacks of
+ * stable frame hashes with counts, and the symbol (name, file, line) of
+ * each frame hash. Slots are claimed with CAS and published with a ready
+ * flag once filled; counts are plain atomic adds. Nothing is ever removed.
+ * A stack with a frame this process has not hashed yet is parked until the
+ * housekeeping job: building the symbol allocates, which a sample, possibly
+ * taken inside the NEWOBJ hook, must not do.
+ */
+#define SHARED_STACK_SLOTS  (1 << 16)
+#define SHARED_STACK_WORDS  (1 << 20)
+#define SHARED_SYMBOL_SLOTS (1 << 16)
+#define SHARED_STRING_BYTES (8 << 20)
+#define SHARED_PENDING_WORDS (1 << 14)
 
 typedef struct {
+    volatile uint64_t key;
+    volatile uint64_t count;
+    volatile uint32_t ready;
+    uint32_t len;	/* frames in the stack / bytes in the symbol */
+    uint64_t offset;
+} shared_slot_t;
+
+typedef struct {
+    volatile uint64_t samples;
+    volatile uint64_t dropped;
+    volatile uint64_t stack_used;
+    volatile uint64_t string_used;
+    shared_slot_t stacks[SHARED_STACK_SLOTS];
+    shared_slot_t symbols[SHARED_SYMBOL_SLOTS];
+    uint64_t stack_words[SHARED_STACK_WORDS];
+    char strings[SHARED_STRING_BYTES];
+} shared_table_t;
+
+typedef struct {
+    size_t id;		/* dense, in order of first sight; the frame's key in results */
     size_t total_samples;
     size_t caller_samples;
     st_table *edges;
     st_table *lines;
 } frame_data_t;
 
+/*
+ * One thread's stack as read by the external sampler, innermost first:
+ * the raw iseq and pc words of each control frame, not yet dereferenced.
+ */
+typedef struct {
+    VALUE thread;
+    int first;		/* first thread read in its tick */
+    int torn;		/* th->cfp moved while the stack was read */
+    int num;
+    uint64_t usec;
+    const rb_iseq_t *iseqs[EXTERNAL_DEPTH];
+    const VALUE *pcs[EXTERNAL_DEPTH];
+} external_slot_t;
+
+/*
+ * Per-thread accounting. running_time_us is the VM's own tally of the time
+ * a thread held the GVL, advanced by the timer thread, so it is only read
+ * when profiling starts or stops and when a thread is first seen.
+ */
+typedef struct {
+    unsigned long started_us;	/* running_time_us when sampling (re)started */
+    unsigned long cpu_us;	/* accumulated over stopped sessions */
+    size_t states[THREAD_KILLED + 1];	/* samples by rb_thread_status */
+} thread_stat_t;
+
+/* :gvl mode: what a thread was doing on a tick */
+enum gvl_state {
+    GVL_HOLDING,
+    GVL_WAITING,
+    GVL_BLOCKED,
+    GVL_SLEEPING,
+    GVL_STATES
+};
+
+/* a distinct stack seen waiting for the GVL; chained on hash collisions */
+typedef struct gvl_stack {
+    struct gvl_stack *next;
+    size_t samples;
+    int num;
+    VALUE frames[1];	/* root first, like raw samples */
+} gvl_stack_t;
+
+/*
+ * per-fiber sample counts, keyed by fiber (or by thread before it has any).
+ * frames aggregates all of the fiber's stacks, running and suspended, with
+ * total samples in the high half of each count and self samples in the low.
+ */
+typedef struct {
+    VALUE thread;
+    size_t samples;
+    size_t suspended;
+    st_table *frames;
+} fiber_count_t;
+
+/*
+ * A finished profile, detached from the sampler by results(). Exports work
+ * from this, and StackProfx::Profile keeps one alive so frame details can
+ * be built on demand instead of all at once.
+ */
+typedef struct {
+    VALUE mode;
+    VALUE interval;
+    size_t overall_signals;
+    size_t overall_samples;
+    size_t during_gc;
+
+    st_table *frames;
+    size_t frame_ids;
+    st_data_t *frames_by_id;	/* built on first lookup by id */
+
+    int raw;
+    int timestamps;
+    raw_store_t raw_samples;
+    raw_store_t raw_timestamps;
+    int raw_fd;
+    st_table *sample_threads;
+
+    VALUE extra;	/* other result keys, filled in when detached */
+} profile_t;
+
 static struct {
     int running;
     int raw;
     int aggregate;
+    int timestamps;
 
     VALUE mode;
     VALUE interval;
     VALUE out;
 
-    VALUE *raw_samples;
-    size_t raw_samples_len;
-    size_t raw_samples_capa;
-    size_t raw_sample_index;
+    /* per sample: frame count, frames (root first), weight */
+    raw_store_t raw_samples;
+    VALUE *raw_sample_last;
+    int raw_fd;
+    off_t raw_file_len;
+    size_t raw_dropped;
+
+    /* varint (usec since previous sample, thread index) pair per raw sample */
+    raw_store_t raw_timestamps;
+    uint64_t last_timestamp;
+    uint64_t sample_timestamp;
+    st_table *sample_threads;
 
     size_t overall_signals;
     size_t overall_samples;
     size_t during_gc;
+    int fibers;
+    st_table *fiber_counts;
+    st_table *thread_stats;
+
+    /* :gvl mode: threads by state per tick, and stacks waiting for the GVL */
+    size_t gvl_states[GVL_STATES];
+    size_t gvl_waiters;
+    st_table *gvl_waits;
+    int cfunc;
+    int method_granularity;
+    void (*record_stack)(VALUE owner, int num);
+    int *lines;		/* lines_buffer, or NULL when lines are not recorded */
+
+    /* native frames captured by the signal handler, consumed by the next tick */
+    int native;
+    void *native_pcs[NATIVE_MAX];
+    volatile int native_len;
+    rb_thread_t *native_thread;
+
+    /*
+     * external: true. A native thread reads the targets' stacks into the
+     * ring, and a postponed job drains it; only the sampler moves head and
+     * only the drain moves tail.
+     */
+    int external;
+    int external_started;
+    int external_restart;	/* forked child: spawn the sampler from the drain */
+    volatile int external_stop;
+    volatile int external_in_gc;	/* set by gctracer, read by the sampler */
+    long external_usec;
+    pthread_t external_thread;
+    pthread_mutex_t external_lock;	/* guards the target list */
+    VALUE *external_targets;
+    rb_thread_t **external_ths;
+    long external_ntargets;
+    long external_capa;
+    external_slot_t *external_ring;
+    st_table *external_iseqs;	/* live rb_iseq_t * => iseq object */
+    const rb_data_type_t *iseq_type;
+    volatile size_t external_head;
+    volatile size_t external_tail;
+    size_t external_samples;
+    size_t external_torn;
+    size_t external_invalid;
+    size_t external_dropped;
+    size_t sample_ticks;
+    uint64_t sampling_ns;
+    uint64_t sampling_max_ns;
     st_table *frames;
+    size_t frame_ids;
+
+    /* reserved ahead of the sampler, refilled by housekeeping */
+    frame_data_t *frame_pool[FRAME_POOL_SIZE];
+    int frame_pool_len;
+    st_table *table_pool[TABLE_POOL_SIZE];
+    int table_pool_len;
+    st_table **grow_queue[GROW_QUEUE_SIZE];
+    int grow_queue_len;
+    int housekeeping;
+    size_t hot_allocations;
 
     st_table *threads;
 
+    /* max_memory: bytes owned by the profiler, and what was shed to stay under */
+    size_t max_memory;
+    size_t memory;
+    int lines_dropped;
+    int raw_dropped_all;
+    int fold_frames;
+    size_t folded_frames;
+    int shed_exhausted;	/* folding freed nothing: stop trying */
+
+    /* shared: true; shared_hashes maps this process's frames to their hash */
+    shared_table_t *shared;
+    st_table *shared_hashes;
+    uint64_t shared_buffer[BUF_SIZE];
+    VALUE shared_pending[SHARED_PENDING_WORDS];	/* num, then frames leaf first */
+    size_t shared_pending_len;
+
+    /* fork: :continue */
+    int fork_continue;
+    int fork_pending;
+    int fork_end_registered;
+
     VALUE frames_buffer[BUF_SIZE];
     int lines_buffer[BUF_SIZE];
 } _stackprofx;
 
-static VALUE sym_object, sym_wall, sym_cpu, sym_custom, sym_name, sym_file, sym_line, sym_threads;
+static VALUE sym_object, sym_wall, sym_cpu, sym_gvl, sym_custom, sym_name, sym_file, sym_line, sym_threads;
 static VALUE sym_samples, sym_total_samples, sym_missed_samples, sym_edges, sym_lines;
 static VALUE sym_version, sym_mode, sym_interval, sym_raw, sym_frames, sym_out, sym_aggregate;
 static VALUE sym_gc_samples, objtracer;
-static VALUE gc_hook;
+static VALUE sym_delta, sym_total_delta;
+static VALUE sym_fibers, sym_thread, sym_suspended_samples, sym_cfunc, sym_native;
+static VALUE sym_granularity, sym_method;
+static VALUE sym_external, sym_torn, sym_invalid;
+static VALUE sym_gvl_states, sym_gvl_waiters, sym_gvl_wait_stacks, sym_holding, sym_waiting, sym_blocked, sym_sleeping;
+static VALUE sym_cpu_time_us, sym_runnable, sym_stopped, sym_stopped_forever, sym_killed;
+static VALUE sym_sample_ticks, sym_sampling_ns, sym_sampling_max_ns, sym_hot_allocations;
+static VALUE sym_profile, sym_id, sym_children, sym_threshold, sym_focus, sym_ignore;
+static VALUE sym_format, sym_hash, sym_pprof, sym_collapsed, sym_speedscope;
+static VALUE sym_raw_file, sym_raw_dropped_samples;
+static VALUE sym_fork, sym_continue, sym_shared, sym_shared_dropped;
+static VALUE sym_max_memory, sym_memory, sym_dropped, sym_folded_frames, sym_exhausted;
+static VALUE sym_timestamps, sym_raw_timestamp_deltas, sym_raw_sample_threads, sym_sample_threads;
+static VALUE gc_hook, symtracer, exttracer, gctracer;
 static VALUE rb_mStackProfx;
 
 static void stackprofx_newobj_handler(VALUE, void*);
+static uint64_t monotonic_usec(void);
+static size_t stackprofx_memsize(void);
+static VALUE stackprofx_results(int argc, VALUE *argv, VALUE self);
+static int frame_mark_i(st_data_t key, st_data_t val, st_data_t arg);
 static void stackprofx_signal_handler(int sig, siginfo_t* sinfo, void* ucontext);
+static void stackprofx_select_recorder(void);
+static void stackprofx_housekeeping_request(void);
+static void stackprofx_reserve(void);
+static void stackprofx_external_start(void);
+static int stackprofx_external_spawn(void);
+static void stackprofx_shared_unmap(void);
+static void stackprofx_shared_flush(void);
+static void stackprofx_external_stop(void);
+#ifdef STACKPROFX_NATIVE
+static void vm_ranges_init(void);
+#endif
+
+static thread_stat_t *
+thread_stat_for(VALUE thread, rb_thread_t *th)
+{
+    thread_stat_t *ts;
+    st_data_t val;
+
+    if (st_lookup(_stackprofx.thread_stats, (st_data_t)thread, &val))
+	return (thread_stat_t *)val;
+    ts = ALLOC(thread_stat_t);
+    MEMZERO(ts, thread_stat_t, 1);
+    ts->started_us = th->running_time_us;
+    st_add_direct(_stackprofx.thread_stats, (st_data_t)thread, (st_data_t)ts);
+    return ts;
+}
+
+static int
+thread_stat_start_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    rb_thread_t *th;
+
+    GetThreadPtr((VALUE)key, th);
+    thread_stat_for((VALUE)key, th)->started_us = th->running_time_us;
+    return ST_CONTINUE;
+}
+
+static int
+thread_stat_stop_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    thread_stat_t *ts = (thread_stat_t *)val;
+    rb_thread_t *th;
+
+    GetThreadPtr((VALUE)key, th);
+    ts->cpu_us += th->running_time_us - ts->started_us;
+    return ST_CONTINUE;
+}
+
+static int
+thread_stats_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE thread = (VALUE)key, details = rb_hash_new(), states = rb_hash_new();
+    thread_stat_t *ts = (thread_stat_t *)val;
+    static ID id_name;
+
+    if (!id_name)
+	id_name = rb_intern("name");
+    /* Thread#name arrived after 2.1 */
+    rb_hash_aset(details, sym_name, rb_respond_to(thread, id_name) ? rb_funcall(thread, id_name, 0) : Qnil);
+    rb_hash_aset(details, sym_cpu_time_us, ULONG2NUM(ts->cpu_us));
+    rb_hash_aset(details, sym_samples, states);
+    rb_hash_aset(states, sym_runnable, SIZET2NUM(ts->states[THREAD_RUNNABLE]));
+    rb_hash_aset(states, sym_stopped, SIZET2NUM(ts->states[THREAD_STOPPED]));
+    rb_hash_aset(states, sym_stopped_forever, SIZET2NUM(ts->states[THREAD_STOPPED_FOREVER]));
+    rb_hash_aset(states, sym_killed, SIZET2NUM(ts->states[THREAD_KILLED]));
+    rb_hash_aset((VALUE)arg, rb_obj_id(thread), details);
+    xfree(ts);
+    return ST_DELETE;
+}
+
+/*
+ * Sampling counts its own allocations in hot_allocations. A new key in an
+ * unpacked st table is one: st mallocs an entry for it.
+ */
+static inline void
+count_st_entry(st_table *table)
+{
+    if (!table->entries_packed)
+	_stackprofx.hot_allocations++;
+}
 
 static VALUE
 stackprofx_start(int argc, VALUE *argv, VALUE self)
 {
     struct sigaction sa;
     struct itimerval timer;
-    VALUE opts = Qnil, mode = Qnil, interval = Qnil, out = Qfalse, threads = Qnil;
-    int raw = 0, aggregate = 1;
+    VALUE opts = Qnil, mode = Qnil, interval = Qnil, out = Qfalse, threads = Qnil, raw_file = Qnil, max_memory = Qnil;
+    VALUE granularity = Qnil;
+    int raw = 0, aggregate = 1, timestamps = 0, fork_continue = 0, shared = 0, fibers = 0, cfunc = 0, native = 0;
+    int external = 0;
 
     if (_stackprofx.running)
 	return Qfalse;
@@ -96,13 +455,52 @@ stackprofx_start(int argc, VALUE *argv, VALUE self)
 	interval = rb_hash_aref(opts, sym_interval);
 	out = rb_hash_aref(opts, sym_out);
 	threads = rb_hash_aref(opts, sym_threads);
+	raw_file = rb_hash_aref(opts, sym_raw_file);
+	max_memory = rb_hash_aref(opts, sym_max_memory);
 
 	if (RTEST(rb_hash_aref(opts, sym_raw)))
 	    raw = 1;
 	if (rb_hash_lookup2(opts, sym_aggregate, Qundef) == Qfalse)
 	    aggregate = 0;
+	if (RTEST(rb_hash_aref(opts, sym_timestamps)))
+	    raw = timestamps = 1;
+	if (RTEST(raw_file))
+	    raw = 1;
+	if (rb_hash_aref(opts, sym_fork) == sym_continue) {
+	    if (!RB_TYPE_P(out, T_STRING))
+		rb_raise(rb_eArgError, "fork: :continue needs an out: path");
+	    fork_continue = 1;
+	}
+	if (RTEST(rb_hash_aref(opts, sym_shared)))
+	    shared = fork_continue = 1;
+	if (RTEST(rb_hash_aref(opts, sym_fibers)))
+	    fibers = 1;
+	if (RTEST(rb_hash_aref(opts, sym_cfunc)))
+	    cfunc = 1;
+	if (RTEST(rb_hash_aref(opts, sym_native)))
+	    native = 1;
+	if (RTEST(rb_hash_aref(opts, sym_external)))
+	    external = 1;
+	granularity = rb_hash_aref(opts, sym_granularity);
+	if (!NIL_P(granularity) && granularity != sym_line && granularity != sym_method)
+	    rb_raise(rb_eArgError, "granularity must be :line or :method");
     }
     if (!RTEST(mode)) mode = sym_wall;
+    if (external) {
+	if (mode != sym_wall)
+	    rb_raise(rb_eArgError, "external: true needs :wall mode");
+	if (native || cfunc || fibers)
+	    rb_raise(rb_eArgError, "external: true records ruby frames only");
+    }
+    if (native) {
+#ifdef STACKPROFX_NATIVE
+	if (mode != sym_wall && mode != sym_cpu)
+	    rb_raise(rb_eArgError, "native: true needs :wall or :cpu mode");
+	vm_ranges_init();
+#else
+	rb_raise(rb_eNotImpError, "native stacks are not supported on this platform");
+#endif
+    }
 
   if (RTEST(threads))
   {
@@ -120,10 +518,44 @@ stackprofx_start(int argc, VALUE *argv, VALUE self)
   }
 
     if (!_stackprofx.frames) {
-	_stackprofx.frames = st_init_numtable();
+	_stackprofx.frames = st_init_numtable_with_size(FRAMES_INIT_BINS);
+	_stackprofx.frame_ids = 0;
 	_stackprofx.overall_signals = 0;
 	_stackprofx.overall_samples = 0;
 	_stackprofx.during_gc = 0;
+	_stackprofx.sample_ticks = 0;
+	_stackprofx.sampling_ns = 0;
+	_stackprofx.sampling_max_ns = 0;
+	_stackprofx.hot_allocations = 0;
+	_stackprofx.raw_dropped = 0;
+	_stackprofx.memory = st_memsize(_stackprofx.frames);
+	_stackprofx.lines_dropped = 0;
+	_stackprofx.raw_dropped_all = 0;
+	_stackprofx.fold_frames = 0;
+	_stackprofx.folded_frames = 0;
+	_stackprofx.shed_exhausted = 0;
+    }
+    _stackprofx.max_memory = RTEST(max_memory) ? NUM2SIZET(max_memory) : 0;
+
+    /* a session only feeds the segment it mapped itself */
+    stackprofx_shared_unmap();
+    if (shared) {
+	void *segment = mmap(NULL, sizeof(shared_table_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (segment == MAP_FAILED)
+	    rb_sys_fail("mmap");
+	_stackprofx.shared = segment;
+	_stackprofx.shared_hashes = st_init_numtable();
+    }
+
+    if (RTEST(raw_file) && _stackprofx.raw_fd < 0) {
+	FilePathValue(raw_file);
+	_stackprofx.raw_fd = open(RSTRING_PTR(raw_file), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (_stackprofx.raw_fd < 0)
+	    rb_sys_fail(RSTRING_PTR(raw_file));
+	/* samples hold VALUEs that mean nothing outside this process */
+	unlink(RSTRING_PTR(raw_file));
+	_stackprofx.raw_file_len = 0;
     }
 
     if (mode == sym_object) {
@@ -131,18 +563,22 @@ stackprofx_start(int argc, VALUE *argv, VALUE self)
 
 	objtracer = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_NEWOBJ, stackprofx_newobj_handler, 0);
 	rb_tracepoint_enable(objtracer);
-    } else if (mode == sym_wall || mode == sym_cpu) {
+    } else if (mode == sym_wall || mode == sym_cpu || mode == sym_gvl) {
 	if (!RTEST(interval)) interval = INT2FIX(1000);
+	if (external) {
+	    /* read by a native thread instead, see stackprofx_external_start */
+	    _stackprofx.external_usec = NUM2LONG(interval);
+	} else {
+	    sa.sa_sigaction = stackprofx_signal_handler;
+	    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	    sigemptyset(&sa.sa_mask);
+	    sigaction(mode == sym_cpu ? SIGPROF : SIGALRM, &sa, NULL);
 
-	sa.sa_sigaction = stackprofx_signal_handler;
-	sa.sa_flags = SA_RESTART | SA_SIGINFO;
-	sigemptyset(&sa.sa_mask);
-	sigaction(mode == sym_wall ? SIGALRM : SIGPROF, &sa, NULL);
-
-	timer.it_interval.tv_sec = 0;
-	timer.it_interval.tv_usec = NUM2LONG(interval);
-	timer.it_value = timer.it_interval;
-	setitimer(mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	    timer.it_interval.tv_sec = 0;
+	    timer.it_interval.tv_usec = NUM2LONG(interval);
+	    timer.it_value = timer.it_interval;
+	    setitimer(mode == sym_cpu ? ITIMER_PROF : ITIMER_REAL, &timer, 0);
+	}
     } else if (mode == sym_custom) {
 	/* sampled manually */
 	interval = Qnil;
@@ -153,9 +589,38 @@ stackprofx_start(int argc, VALUE *argv, VALUE self)
     _stackprofx.running = 1;
     _stackprofx.raw = raw;
     _stackprofx.aggregate = aggregate;
+    _stackprofx.timestamps = timestamps;
+    _stackprofx.fork_continue = fork_continue;
+    _stackprofx.fibers = fibers;
+    _stackprofx.cfunc = cfunc;
+    _stackprofx.native = native;
+    _stackprofx.method_granularity = granularity == sym_method;
+    stackprofx_select_recorder();
+    _stackprofx.native_len = 0;
+    if (fibers && !_stackprofx.fiber_counts)
+	_stackprofx.fiber_counts = st_init_numtable();
+    if (mode == sym_gvl && !_stackprofx.gvl_waits) {
+	_stackprofx.gvl_waits = st_init_numtable();
+	MEMZERO(_stackprofx.gvl_states, size_t, GVL_STATES);
+	_stackprofx.gvl_waiters = 0;
+    }
+    if (timestamps) {
+	if (!_stackprofx.sample_threads)
+	    _stackprofx.sample_threads = st_init_numtable();
+	_stackprofx.last_timestamp = monotonic_usec();
+    }
     _stackprofx.mode = mode;
     _stackprofx.interval = interval;
     _stackprofx.out = out;
+    _stackprofx.external = external;
+    if (!_stackprofx.thread_stats)
+	_stackprofx.thread_stats = st_init_numtable();
+    st_foreach(_stackprofx.threads ?: GET_THREAD()->vm->living_threads, thread_stat_start_i, 0);
+    stackprofx_reserve();
+    if (_stackprofx.max_memory)
+	_stackprofx.memory = stackprofx_memsize();
+    if (external)
+	stackprofx_external_start();
 
     return Qtrue;
 }
@@ -170,6 +635,9 @@ stackprofx_stop(VALUE self)
 	return Qfalse;
     _stackprofx.running = 0;
 
+    if (_stackprofx.thread_stats)
+	st_foreach(_stackprofx.thread_stats, thread_stat_stop_i, 0);
+
     if (_stackprofx.threads)
     {
         st_free_table(_stackprofx.threads);
@@ -178,318 +646,3693 @@ stackprofx_stop(VALUE self)
 
     if (_stackprofx.mode == sym_object) {
 	rb_tracepoint_disable(objtracer);
-    } else if (_stackprofx.mode == sym_wall || _stackprofx.mode == sym_cpu) {
+    } else if (_stackprofx.external) {
+	stackprofx_external_stop();
+    } else if (_stackprofx.mode == sym_wall || _stackprofx.mode == sym_cpu || _stackprofx.mode == sym_gvl) {
 	memset(&timer, 0, sizeof(timer));
-	setitimer(_stackprofx.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	setitimer(_stackprofx.mode == sym_cpu ? ITIMER_PROF : ITIMER_REAL, &timer, 0);
 
 	sa.sa_handler = SIG_IGN;
 	sa.sa_flags = SA_RESTART;
 	sigemptyset(&sa.sa_mask);
-	sigaction(_stackprofx.mode == sym_wall ? SIGALRM : SIGPROF, &sa, NULL);
+	sigaction(_stackprofx.mode == sym_cpu ? SIGPROF : SIGALRM, &sa, NULL);
     } else if (_stackprofx.mode == sym_custom) {
 	/* sampled manually */
     } else {
 	rb_raise(rb_eArgError, "unknown profiler mode");
     }
+    stackprofx_shared_flush();
 
     return Qtrue;
 }
 
+/*
+ * Frames folded away under memory pressure share this key; everything that
+ * symbolizes a frame goes through the helpers below.
+ */
+#define FRAME_OTHER Qnil
+
+/*
+ * C function frames have no iseq. They are keyed by an interned
+ * (class, method id) pair whose address is tagged with FRAME_CFUNC_TAG, so
+ * the key can never be mistaken for a heap object.
+ */
+typedef struct {
+    VALUE klass;
+    ID mid;
+} cfunc_frame_t;
+
+#define FRAME_TAG_MASK ((VALUE)3)
+#define FRAME_CFUNC_TAG ((VALUE)1)
+#define FRAME_CFUNC_P(frame) (((VALUE)(frame) & FRAME_TAG_MASK) == FRAME_CFUNC_TAG)
+#define FRAME_CFUNC(frame) ((cfunc_frame_t *)((VALUE)(frame) & ~FRAME_TAG_MASK))
+#define FRAME_NATIVE_TAG ((VALUE)2)
+#define FRAME_NATIVE_P(frame) (((VALUE)(frame) & FRAME_TAG_MASK) == FRAME_NATIVE_TAG)
+#define FRAME_NATIVE(frame) ((native_frame_t *)((VALUE)(frame) & ~FRAME_TAG_MASK))
+
+static st_table *cfunc_frames;
+
 static int
-frame_edges_i(st_data_t key, st_data_t val, st_data_t arg)
+cfunc_frame_cmp(st_data_t a, st_data_t b)
 {
-    VALUE edges = (VALUE)arg;
+    const cfunc_frame_t *x = (const cfunc_frame_t *)a, *y = (const cfunc_frame_t *)b;
+    return !(x->klass == y->klass && x->mid == y->mid);
+}
 
-    intptr_t weight = (intptr_t)val;
-    rb_hash_aset(edges, rb_obj_id((VALUE)key), INT2FIX(weight));
-    return ST_CONTINUE;
+static st_index_t
+cfunc_frame_hash(st_data_t key)
+{
+    const cfunc_frame_t *f = (const cfunc_frame_t *)key;
+    return (st_index_t)(f->klass >> 3) * 31 + (st_index_t)f->mid;
+}
+
+static const struct st_hash_type cfunc_frame_type = {
+    cfunc_frame_cmp,
+    cfunc_frame_hash,
+};
+
+static VALUE
+cfunc_frame_key(const rb_method_entry_t *me)
+{
+    cfunc_frame_t lookup, *frame;
+    st_data_t val;
+
+    lookup.klass = me->klass;
+    lookup.mid = me->called_id;
+    if (st_lookup(cfunc_frames, (st_data_t)&lookup, &val)) {
+	frame = (cfunc_frame_t *)val;
+    } else {
+	frame = ALLOC(cfunc_frame_t);
+	*frame = lookup;
+	st_add_direct(cfunc_frames, (st_data_t)frame, (st_data_t)frame);
+	_stackprofx.hot_allocations++;
+	count_st_entry(cfunc_frames);
+    }
+    return (VALUE)frame | FRAME_CFUNC_TAG;
+}
+
+static VALUE
+cfunc_frame_label(cfunc_frame_t *frame)
+{
+    VALUE klass = frame->klass, label, name;
+    const char *sep = "#";
+
+    if (!klass)
+	return rb_str_new_cstr("(unknown)");
+    if (FL_TEST(klass, FL_SINGLETON)) {
+	VALUE attached = rb_iv_get(klass, "__attached__");
+	if (RB_TYPE_P(attached, T_CLASS) || RB_TYPE_P(attached, T_MODULE)) {
+	    klass = attached;
+	    sep = ".";
+	}
+    }
+    label = rb_str_dup(rb_class_path(klass));
+    rb_str_cat2(label, sep);
+    name = rb_id2str(frame->mid);
+    rb_str_append(label, RTEST(name) ? name : rb_str_new_cstr("(unknown)"));
+    return label;
+}
+
+/*
+ * Symbols outlive profiling sessions: each iseq is resolved once into frozen
+ * strings, and the entry is dropped when the iseq itself is freed. The cache
+ * holds the iseqs weakly and marks only the strings.
+ */
+typedef struct {
+    VALUE name;
+    VALUE path;
+    VALUE line;
+} frame_symbols_t;
+
+static st_table *frame_symbols;
+
+static void
+frame_symbols_freeobj(VALUE tpval, void *data)
+{
+    rb_trace_arg_t *tparg;
+    st_data_t key, val;
+
+    if (!frame_symbols->num_entries)
+	return;
+    tparg = rb_tracearg_from_tracepoint(tpval);
+    key = (st_data_t)rb_tracearg_object(tparg);
+    if (st_delete(frame_symbols, &key, &val)) {
+	xfree((void *)val);
+	/* nothing left to invalidate: stop hooking every free */
+	if (!frame_symbols->num_entries)
+	    rb_tracepoint_disable(symtracer);
+    }
 }
 
 static int
-frame_lines_i(st_data_t key, st_data_t val, st_data_t arg)
+frame_symbols_mark_i(st_data_t key, st_data_t val, st_data_t arg)
 {
-    VALUE lines = (VALUE)arg;
+    frame_symbols_t *sym = (frame_symbols_t *)val;
 
-    size_t weight = (size_t)val;
-    size_t total = weight & (~(size_t)0 << (8*SIZEOF_SIZE_T/2));
-    weight -= total;
-    total = total >> (8*SIZEOF_SIZE_T/2);
-    rb_hash_aset(lines, INT2FIX(key), rb_ary_new3(2, ULONG2NUM(total), ULONG2NUM(weight)));
+    rb_gc_mark(sym->name);
+    rb_gc_mark(sym->path);
     return ST_CONTINUE;
 }
 
-static int
-frame_i(st_data_t key, st_data_t val, st_data_t arg)
+static frame_symbols_t *
+frame_symbols_for(VALUE frame)
 {
-    VALUE frame = (VALUE)key;
-    frame_data_t *frame_data = (frame_data_t *)val;
-    VALUE results = (VALUE)arg;
-    VALUE details = rb_hash_new();
-    VALUE name, file, edges, lines;
-    VALUE line;
+    frame_symbols_t *sym;
+    st_data_t val;
+    VALUE file;
 
-    rb_hash_aset(results, rb_obj_id(frame), details);
+    if (st_lookup(frame_symbols, (st_data_t)frame, &val))
+	return (frame_symbols_t *)val;
 
-    name = rb_profile_frame_full_label(frame);
-    rb_hash_aset(details, sym_name, name);
+    if (!frame_symbols->num_entries) {
+	if (!symtracer)
+	    symtracer = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_FREEOBJ, frame_symbols_freeobj, 0);
+	rb_tracepoint_enable(symtracer);
+    }
 
+    /* inserted first so the strings are marked while being built */
+    sym = ALLOC(frame_symbols_t);
+    sym->name = sym->path = Qnil;
+    sym->line = INT2FIX(0);
+    st_insert(frame_symbols, (st_data_t)frame, (st_data_t)sym);
+
+    sym->name = rb_profile_frame_full_label(frame);
+    if (!NIL_P(sym->name))
+	sym->name = rb_obj_freeze(rb_str_dup(sym->name));
     file = rb_profile_frame_absolute_path(frame);
     if (NIL_P(file))
 	file = rb_profile_frame_path(frame);
-    rb_hash_aset(details, sym_file, file);
+    /* the iseq's own path may be a caller's string (eval); keep a copy */
+    if (!NIL_P(file))
+	file = rb_obj_freeze(rb_str_dup(file));
+    sym->path = file;
+    sym->line = rb_profile_frame_first_lineno(frame);
+    return sym;
+}
 
-    if ((line = rb_profile_frame_first_lineno(frame)) != INT2FIX(0))
-	rb_hash_aset(details, sym_line, line);
+/*
+ * Native frames are interned per code address, tagged like C function
+ * frames. The signal handler only records addresses; dladdr runs on first
+ * use of a frame's name and its result stays cached with the frame.
+ */
+typedef struct {
+    void *pc;
+    VALUE name;		/* 0 until resolved */
+    VALUE path;
+} native_frame_t;
 
-    rb_hash_aset(details, sym_total_samples, SIZET2NUM(frame_data->total_samples));
-    rb_hash_aset(details, sym_samples, SIZET2NUM(frame_data->caller_samples));
+static st_table *native_frames;
 
-    if (frame_data->edges) {
-        edges = rb_hash_new();
-        rb_hash_aset(details, sym_edges, edges);
-        st_foreach(frame_data->edges, frame_edges_i, (st_data_t)edges);
-        st_free_table(frame_data->edges);
-        frame_data->edges = NULL;
-    }
+static VALUE
+native_frame_key(void *pc)
+{
+    native_frame_t *frame;
+    st_data_t val;
 
-    if (frame_data->lines) {
-	lines = rb_hash_new();
-	rb_hash_aset(details, sym_lines, lines);
-	st_foreach(frame_data->lines, frame_lines_i, (st_data_t)lines);
-	st_free_table(frame_data->lines);
-	frame_data->lines = NULL;
+    if (st_lookup(native_frames, (st_data_t)pc, &val)) {
+	frame = (native_frame_t *)val;
+    } else {
+	frame = ALLOC(native_frame_t);
+	frame->pc = pc;
+	frame->name = frame->path = 0;
+	st_add_direct(native_frames, (st_data_t)pc, (st_data_t)frame);
+	_stackprofx.hot_allocations++;
+	count_st_entry(native_frames);
     }
-
-    xfree(frame_data);
-    return ST_DELETE;
+    return (VALUE)frame | FRAME_NATIVE_TAG;
 }
 
-static VALUE
-stackprofx_results(int argc, VALUE *argv, VALUE self)
+static native_frame_t *
+native_frame_resolve(native_frame_t *frame)
 {
-    VALUE results, frames;
+    const char *name = NULL, *path = NULL;
 
-    if (!_stackprofx.frames || _stackprofx.running)
-	return Qnil;
+    if (frame->name)
+	return frame;
+#ifdef STACKPROFX_NATIVE
+    {
+	Dl_info info;
+	if (dladdr(frame->pc, &info)) {
+	    name = info.dli_sname;
+	    path = info.dli_fname;
+	}
+    }
+#endif
+    frame->name = rb_obj_freeze(name ? rb_str_new_cstr(name) : rb_sprintf("%p", frame->pc));
+    frame->path = rb_obj_freeze(rb_str_new_cstr(path ? path : "(native)"));
+    return frame;
+}
 
-    results = rb_hash_new();
-    rb_hash_aset(results, sym_version, DBL2NUM(1.1));
-    rb_hash_aset(results, sym_mode, _stackprofx.mode);
-    rb_hash_aset(results, sym_interval, _stackprofx.interval);
-    rb_hash_aset(results, sym_samples, SIZET2NUM(_stackprofx.overall_samples));
-    rb_hash_aset(results, sym_gc_samples, SIZET2NUM(_stackprofx.during_gc));
-    rb_hash_aset(results, sym_missed_samples, SIZET2NUM(_stackprofx.overall_signals - _stackprofx.overall_samples));
+static int
+native_frame_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    native_frame_t *frame = (native_frame_t *)val;
 
-    frames = rb_hash_new();
-    rb_hash_aset(results, sym_frames, frames);
-    st_foreach(_stackprofx.frames, frame_i, (st_data_t)frames);
+    if (frame->name) rb_gc_mark(frame->name);
+    if (frame->path) rb_gc_mark(frame->path);
+    return ST_CONTINUE;
+}
 
-    st_free_table(_stackprofx.frames);
-    _stackprofx.frames = NULL;
+#ifdef STACKPROFX_NATIVE
+/* executable segments of the object holding the VM: unwinding stops there */
+static struct {
+    uintptr_t start;
+    uintptr_t end;
+} vm_ranges[8];
+static int vm_ranges_len;
 
-    if (_stackprofx.raw && _stackprofx.raw_samples_len) {
-	size_t len, n, o;
-	VALUE raw_samples = rb_ary_new_capa(_stackprofx.raw_samples_len);
+static int
+vm_ranges_i(struct dl_phdr_info *info, size_t size, void *data)
+{
+    uintptr_t target = (uintptr_t)data, start;
+    int i, found = 0;
 
-	for (n = 0; n < _stackprofx.raw_samples_len; n++) {
-	    len = (size_t)_stackprofx.raw_samples[n];
-	    rb_ary_push(raw_samples, SIZET2NUM(len));
+    for (i = 0; i < info->dlpi_phnum; i++) {
+	const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+	start = info->dlpi_addr + ph->p_vaddr;
+	if (ph->p_type == PT_LOAD && target >= start && target < start + ph->p_memsz)
+	    found = 1;
+    }
+    if (!found)
+	return 0;
 
-	    for (o = 0, n++; o < len; n++, o++)
-		rb_ary_push(raw_samples, rb_obj_id(_stackprofx.raw_samples[n]));
-	    rb_ary_push(raw_samples, SIZET2NUM((size_t)_stackprofx.raw_samples[n]));
+    for (i = 0; i < info->dlpi_phnum && vm_ranges_len < 8; i++) {
+	const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+	if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {
+	    start = info->dlpi_addr + ph->p_vaddr;
+	    vm_ranges[vm_ranges_len].start = start;
+	    vm_ranges[vm_ranges_len].end = start + ph->p_memsz;
+	    vm_ranges_len++;
 	}
+    }
+    return 1;
+}
+
+static void
+vm_ranges_init(void)
+{
+    if (!vm_ranges_len)
+	dl_iterate_phdr(vm_ranges_i, (void *)(uintptr_t)&rb_profile_frames);
+}
 
-	free(_stackprofx.raw_samples);
-	_stackprofx.raw_samples = NULL;
-	_stackprofx.raw_samples_len = 0;
-	_stackprofx.raw_samples_capa = 0;
-	_stackprofx.raw_sample_index = 0;
-	_stackprofx.raw = 0;
+static inline int
+vm_pc_p(uintptr_t pc)
+{
+    int i;
 
-	rb_hash_aset(results, sym_raw, raw_samples);
-    }
+    for (i = 0; i < vm_ranges_len; i++)
+	if (pc >= vm_ranges[i].start && pc < vm_ranges[i].end)
+	    return 1;
+    return 0;
+}
 
-    if (argc == 1)
-	_stackprofx.out = argv[0];
+/*
+ * Called from the signal handler: follow the frame pointer chain from the
+ * interrupted context, within the thread's machine stack, until reaching
+ * code of the VM itself. Code built without frame pointers fails the
+ * bounds checks and leaves just the interrupted address.
+ */
+static void
+stackprofx_capture_native(void *ucontext)
+{
+    ucontext_t *uc = ucontext;
+    rb_thread_t *th;
+    uintptr_t pc, fp, sp, top;
+    int n = 0;
 
-    if (RTEST(_stackprofx.out)) {
-	VALUE file;
-	if (RB_TYPE_P(_stackprofx.out, T_STRING)) {
-	    file = rb_file_open_str(_stackprofx.out, "w");
-	} else {
-	    file = rb_io_check_io(_stackprofx.out);
-	}
-	rb_marshal_dump(results, file);
-	rb_io_flush(file);
-	_stackprofx.out = Qnil;
-	return file;
-    } else {
-	return results;
+    if (_stackprofx.native_len)
+	return;		/* the last capture has not been recorded yet */
+    th = ruby_current_thread;
+    if (!th || !pthread_equal(th->thread_id, pthread_self()))
+	return;		/* interrupted a thread that is not running ruby */
+
+#if defined(__x86_64__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+    sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+#else
+    pc = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+    sp = (uintptr_t)uc->uc_mcontext.sp;
+#endif
+    top = (uintptr_t)th->machine_stack_start;
+
+    while (n < NATIVE_MAX && !vm_pc_p(pc)) {
+	_stackprofx.native_pcs[n++] = (void *)pc;
+	if (fp < sp || fp + 2 * sizeof(uintptr_t) > top || (fp & (sizeof(uintptr_t) - 1)))
+	    break;
+	/* return addresses point past the call; step back into it */
+	pc = ((uintptr_t *)fp)[1] - 1;
+	sp = fp + sizeof(uintptr_t);
+	fp = ((uintptr_t *)fp)[0];
+    }
+    if (n) {
+	_stackprofx.native_thread = th;
+	_stackprofx.native_len = n;
     }
 }
+#endif
 
 static VALUE
-stackprofx_run(int argc, VALUE *argv, VALUE self)
+frame_full_label(VALUE frame)
 {
-    rb_need_block();
-    stackprofx_start(argc, argv, self);
-    rb_ensure(rb_yield, Qundef, stackprofx_stop, self);
-    return stackprofx_results(0, 0, self);
+    if (frame == FRAME_OTHER)
+	return rb_str_new_cstr("(other)");
+    if (FRAME_CFUNC_P(frame))
+	return cfunc_frame_label(FRAME_CFUNC(frame));
+    if (FRAME_NATIVE_P(frame))
+	return native_frame_resolve(FRAME_NATIVE(frame))->name;
+    return frame_symbols_for(frame)->name;
 }
 
 static VALUE
-stackprofx_running_p(VALUE self)
+frame_path(VALUE frame)
 {
-    return _stackprofx.running ? Qtrue : Qfalse;
+    if (frame == FRAME_OTHER)
+	return rb_str_new_cstr("(other)");
+    if (FRAME_CFUNC_P(frame))
+	return rb_str_new_cstr("(cfunc)");
+    if (FRAME_NATIVE_P(frame))
+	return native_frame_resolve(FRAME_NATIVE(frame))->path;
+    return frame_symbols_for(frame)->path;
 }
 
-static inline frame_data_t *
-sample_for(VALUE frame)
+static VALUE
+frame_first_lineno(VALUE frame)
 {
-    st_data_t key = (st_data_t)frame, val = 0;
-    frame_data_t *frame_data;
+    if (frame == FRAME_OTHER || FRAME_CFUNC_P(frame) || FRAME_NATIVE_P(frame))
+	return INT2FIX(0);
+    return frame_symbols_for(frame)->line;
+}
 
-    if (st_lookup(_stackprofx.frames, key, &val)) {
-        frame_data = (frame_data_t *)val;
-    } else {
-        frame_data = ALLOC_N(frame_data_t, 1);
-        MEMZERO(frame_data, frame_data_t, 1);
-        val = (st_data_t)frame_data;
-        st_insert(_stackprofx.frames, key, val);
-    }
+static size_t
+frame_id(profile_t *prof, VALUE frame)
+{
+    st_data_t val = 0;
 
-    return frame_data;
+    if (!st_lookup(prof->frames, (st_data_t)frame, &val))
+	return 0;
+    return ((frame_data_t *)val)->id;
 }
 
+struct frame_details_arg {
+    profile_t *prof;
+    VALUE hash;
+};
+
 static int
-numtable_increment_callback(st_data_t *key, st_data_t *value, st_data_t arg, int existing)
+frame_edges_i(st_data_t key, st_data_t val, st_data_t arg)
 {
-    size_t *weight = (size_t *)value;
-    size_t increment = (size_t)arg;
-
-    if (existing)
-	(*weight) += increment;
-    else
-	*weight = increment;
+    struct frame_details_arg *da = (struct frame_details_arg *)arg;
 
+    intptr_t weight = (intptr_t)val;
+    rb_hash_aset(da->hash, SIZET2NUM(frame_id(da->prof, (VALUE)key)), INT2FIX(weight));
     return ST_CONTINUE;
 }
 
-void
-st_numtable_increment(st_table *table, st_data_t key, size_t increment)
+static int
+frame_lines_i(st_data_t key, st_data_t val, st_data_t arg)
 {
-    st_update(table, key, numtable_increment_callback, (st_data_t)increment);
+    VALUE lines = (VALUE)arg;
+
+    size_t weight = (size_t)val;
+    size_t total = weight & (~(size_t)0 << (8*SIZEOF_SIZE_T/2));
+    weight -= total;
+    total = total >> (8*SIZEOF_SIZE_T/2);
+    rb_hash_aset(lines, INT2FIX(key), rb_ary_new3(2, ULONG2NUM(total), ULONG2NUM(weight)));
+    return ST_CONTINUE;
 }
 
-// thanks to https://bugs.ruby-lang.org/issues/10602
-int
-rb_profile_frames_thread(int start, int limit, VALUE *buff, int *lines, rb_thread_t *th)
+static VALUE
+frame_details(profile_t *prof, VALUE frame, frame_data_t *frame_data)
+{
+    VALUE details = rb_hash_new();
+    VALUE name, file, edges, lines;
+    VALUE line;
+    struct frame_details_arg da;
+
+    name = frame_full_label(frame);
+    rb_hash_aset(details, sym_name, name);
+
+    file = frame_path(frame);
+    rb_hash_aset(details, sym_file, file);
+
+    if ((line = frame_first_lineno(frame)) != INT2FIX(0))
+	rb_hash_aset(details, sym_line, line);
+    if (FRAME_CFUNC_P(frame))
+	rb_hash_aset(details, sym_cfunc, Qtrue);
+    if (FRAME_NATIVE_P(frame))
+	rb_hash_aset(details, sym_native, Qtrue);
+
+    rb_hash_aset(details, sym_total_samples, SIZET2NUM(frame_data->total_samples));
+    rb_hash_aset(details, sym_samples, SIZET2NUM(frame_data->caller_samples));
+
+    if (frame_data->edges) {
+        edges = rb_hash_new();
+        rb_hash_aset(details, sym_edges, edges);
+        da.prof = prof;
+        da.hash = edges;
+        st_foreach(frame_data->edges, frame_edges_i, (st_data_t)&da);
+    }
+
+    if (frame_data->lines) {
+	lines = rb_hash_new();
+	rb_hash_aset(details, sym_lines, lines);
+	st_foreach(frame_data->lines, frame_lines_i, (st_data_t)lines);
+    }
+
+    return details;
+}
+
+static int
+frame_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct frame_details_arg *da = (struct frame_details_arg *)arg;
+    frame_data_t *frame_data = (frame_data_t *)val;
+
+    rb_hash_aset(da->hash, SIZET2NUM(frame_data->id), frame_details(da->prof, (VALUE)key, frame_data));
+    return ST_CONTINUE;
+}
+
+static raw_chunk_t *
+raw_chunk_map(size_t size)
+{
+    raw_chunk_t *chunk;
+    size_t mapped = size + offsetof(raw_chunk_t, data);
+
+    mapped = (mapped + RAW_CHUNK_SIZE - 1) / RAW_CHUNK_SIZE * RAW_CHUNK_SIZE;
+
+    if (_stackprofx.raw_fd >= 0) {
+	if (ftruncate(_stackprofx.raw_fd, _stackprofx.raw_file_len + (off_t)mapped) != 0)
+	    return NULL;
+	chunk = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, _stackprofx.raw_fd, _stackprofx.raw_file_len);
+	if (chunk == MAP_FAILED)
+	    return NULL;
+	_stackprofx.raw_file_len += (off_t)mapped;
+    } else {
+	chunk = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+	    return NULL;
+    }
+
+    _stackprofx.memory += mapped;
+    chunk->next = NULL;
+    chunk->mapped = mapped;
+    chunk->len = 0;
+    return chunk;
+}
+
+/* Room for size contiguous bytes at the end of the store, or NULL. */
+static void *
+raw_store_reserve(raw_store_t *store, size_t size)
+{
+    raw_chunk_t *tail = store->tail;
+
+    if (!tail || tail->mapped - offsetof(raw_chunk_t, data) - tail->len < size) {
+	raw_chunk_t *chunk = store->spare;
+
+	if (chunk && chunk->mapped - offsetof(raw_chunk_t, data) >= size) {
+	    store->spare = NULL;
+	} else {
+	    chunk = raw_chunk_map(size);
+	    if (!chunk)
+		return NULL;
+	    store->mapped += chunk->mapped;
+	    _stackprofx.hot_allocations++;
+	}
+	if (tail)
+	    tail->next = chunk;
+	else
+	    store->head = chunk;
+	store->tail = tail = chunk;
+	stackprofx_housekeeping_request();
+    }
+    return tail->data + tail->len;
+}
+
+static void
+raw_store_commit(raw_store_t *store, size_t size)
+{
+    store->tail->len += size;
+    store->len += size;
+}
+
+static void
+raw_store_free(raw_store_t *store)
+{
+    raw_chunk_t *chunk = store->head, *next;
+
+    while (chunk) {
+	next = chunk->next;
+	munmap(chunk, chunk->mapped);
+	chunk = next;
+    }
+    if (store->spare)
+	munmap(store->spare, store->spare->mapped);
+    store->head = store->tail = store->spare = NULL;
+    store->len = 0;
+    store->mapped = 0;
+}
+
+static void
+raw_iter_init(raw_iter_t *it, raw_store_t *store)
+{
+    it->chunk = store->head;
+    it->off = 0;
+}
+
+/*
+ * A raw sample is (frame count, frames root first..., weight). When lines
+ * were recorded, RAW_LINES_FLAG is set in the count and the frames' line
+ * numbers follow as ints, also root first.
+ */
+#define RAW_LINES_FLAG ((VALUE)1 << (SIZEOF_VALUE * 8 - 1))
+#define RAW_LEN(sample) ((size_t)((sample)[0] & ~RAW_LINES_FLAG))
+#define RAW_LINE_WORDS(num) (((size_t)(num) * sizeof(int) + sizeof(VALUE) - 1) / sizeof(VALUE))
+#define RAW_LINES(sample) \
+    ((sample)[0] & RAW_LINES_FLAG ? (int *)&(sample)[RAW_LEN(sample) + 2] : NULL)
+#define RAW_WORDS(sample) \
+    (RAW_LEN(sample) + 2 + ((sample)[0] & RAW_LINES_FLAG ? RAW_LINE_WORDS(RAW_LEN(sample)) : 0))
+
+/* Next raw sample, or NULL at the end. */
+static VALUE *
+raw_samples_next(raw_iter_t *it)
+{
+    VALUE *sample;
+
+    while (it->chunk && it->off >= it->chunk->len) {
+	it->chunk = it->chunk->next;
+	it->off = 0;
+    }
+    if (!it->chunk)
+	return NULL;
+
+    sample = (VALUE *)(it->chunk->data + it->off);
+    it->off += sizeof(VALUE) * RAW_WORDS(sample);
+    return sample;
+}
+
+static const unsigned char *
+varint_decode(const unsigned char *ptr, uint64_t *val)
+{
+    int shift = 0;
+
+    *val = 0;
+    do {
+	*val |= (uint64_t)(*ptr & 0x7f) << shift;
+	shift += 7;
+    } while (*ptr++ & 0x80);
+    return ptr;
+}
+
+/* Next (usec delta, thread index) pair, 0 at the end. */
+static int
+raw_timestamps_next(raw_iter_t *it, uint64_t *delta, uint64_t *thread)
+{
+    const unsigned char *ptr, *end;
+
+    while (it->chunk && it->off >= it->chunk->len) {
+	it->chunk = it->chunk->next;
+	it->off = 0;
+    }
+    if (!it->chunk)
+	return 0;
+
+    ptr = (const unsigned char *)it->chunk->data + it->off;
+    end = varint_decode(varint_decode(ptr, delta), thread);
+    it->off += (size_t)(end - ptr);
+    return 1;
+}
+
+/* "%{pid}" in an out path is replaced by the writing process's pid */
+static VALUE
+stackprofx_out_path(VALUE out)
+{
+    return rb_funcall(out, rb_intern("gsub"), 2, rb_str_new_cstr("%{pid}"), rb_obj_as_string(INT2NUM(getpid())));
+}
+
+static VALUE
+stackprofx_out_file(const char *mode)
+{
+    if (RB_TYPE_P(_stackprofx.out, T_STRING))
+	return rb_file_open_str(stackprofx_out_path(_stackprofx.out), mode);
+    return rb_io_check_io(_stackprofx.out);
+}
+
+static VALUE
+stackprofx_write_results(VALUE results, VALUE format)
+{
+    if (RTEST(_stackprofx.out)) {
+	VALUE file = stackprofx_out_file(format == sym_pprof ? "wb" : "w");
+	if (RB_TYPE_P(results, T_STRING))
+	    rb_io_write(file, results);
+	else
+	    rb_marshal_dump(results, file);
+	rb_io_flush(file);
+	_stackprofx.out = Qnil;
+	return file;
+    } else {
+	return results;
+    }
+}
+
+static int
+frame_free_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_data_t *frame_data = (frame_data_t *)val;
+
+    if (frame_data->edges)
+	st_free_table(frame_data->edges);
+    if (frame_data->lines)
+	st_free_table(frame_data->lines);
+    xfree(frame_data);
+    return ST_DELETE;
+}
+
+/*
+ * pprof export: profile.proto encoded by hand. Submessages are built in a
+ * scratch string and then appended with their length prefix.
+ */
+
+#define PPROF_WIRE_VARINT 0
+#define PPROF_WIRE_BYTES  2
+
+typedef struct {
+    profile_t *prof;
+    VALUE buf;
+    VALUE scratch;
+    VALUE strings;
+    VALUE string_table;
+    long string_count;
+    VALUE sample;
+    VALUE ids;
+    VALUE values;
+} pprof_t;
+
+static void
+pb_varint(VALUE buf, uint64_t val)
+{
+    char tmp[10];
+    int len = 0;
+
+    do {
+	tmp[len] = (char)(val & 0x7f);
+	val >>= 7;
+	if (val) tmp[len] |= 0x80;
+	len++;
+    } while (val);
+    rb_str_buf_cat(buf, tmp, len);
+}
+
+static void
+pb_uint(VALUE buf, int field, uint64_t val)
+{
+    pb_varint(buf, ((uint64_t)field << 3) | PPROF_WIRE_VARINT);
+    pb_varint(buf, val);
+}
+
+static void
+pb_bytes(VALUE buf, int field, const char *ptr, long len)
+{
+    pb_varint(buf, ((uint64_t)field << 3) | PPROF_WIRE_BYTES);
+    pb_varint(buf, (uint64_t)len);
+    rb_str_buf_cat(buf, ptr, len);
+}
+
+static void
+pb_message(VALUE buf, int field, VALUE msg)
+{
+    pb_bytes(buf, field, RSTRING_PTR(msg), RSTRING_LEN(msg));
+    rb_str_resize(msg, 0);
+}
+
+static uint64_t
+pprof_string(pprof_t *pp, VALUE str)
+{
+    VALUE idx;
+
+    if (NIL_P(str))
+	str = rb_str_new(0, 0);
+    idx = rb_hash_lookup2(pp->strings, str, Qundef);
+    if (idx == Qundef) {
+	idx = LONG2NUM(pp->string_count++);
+	rb_hash_aset(pp->strings, str, idx);
+	pb_bytes(pp->string_table, 6, RSTRING_PTR(str), RSTRING_LEN(str));
+    }
+    return NUM2ULL(idx);
+}
+
+static void
+pprof_value_type(pprof_t *pp, int field, const char *type, const char *unit)
+{
+    uint64_t type_idx = pprof_string(pp, rb_str_new_cstr(type));
+    uint64_t unit_idx = pprof_string(pp, rb_str_new_cstr(unit));
+
+    pb_uint(pp->scratch, 1, type_idx);
+    pb_uint(pp->scratch, 2, unit_idx);
+    pb_message(pp->buf, field, pp->scratch);
+}
+
+static int
+pprof_function_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE frame = (VALUE)key;
+    pprof_t *pp = (pprof_t *)arg;
+    uint64_t id = ((frame_data_t *)val)->id;
+    uint64_t name, file;
+    VALUE line;
+
+    name = pprof_string(pp, frame_full_label(frame));
+    file = pprof_string(pp, frame_path(frame));
+    line = frame_first_lineno(frame);
+
+    pb_uint(pp->scratch, 1, id);
+    pb_uint(pp->scratch, 2, name);
+    pb_uint(pp->scratch, 3, name);
+    pb_uint(pp->scratch, 4, file);
+    pb_uint(pp->scratch, 5, NUM2ULL(line));
+    pb_message(pp->buf, 5, pp->scratch);
+    return ST_CONTINUE;
+}
+
+static void
+pprof_location(pprof_t *pp, uint64_t id, uint64_t function_id, long line)
+{
+    VALUE line_msg = rb_str_buf_new(16);
+
+    pb_uint(line_msg, 1, function_id);
+    pb_uint(line_msg, 2, (uint64_t)line);
+
+    pb_uint(pp->scratch, 1, id);
+    pb_message(pp->scratch, 4, line_msg);
+    pb_message(pp->buf, 4, pp->scratch);
+}
+
+static void
+pprof_sample(pprof_t *pp, size_t weight)
+{
+    uint64_t interval = NIL_P(pp->prof->interval) ? 1 : NUM2ULL(pp->prof->interval);
+
+    pb_varint(pp->values, weight);
+    if (pp->prof->mode == sym_wall || pp->prof->mode == sym_cpu || pp->prof->mode == sym_gvl)
+	pb_varint(pp->values, weight * interval * 1000);
+    else if (pp->prof->mode == sym_object)
+	pb_varint(pp->values, weight * interval);
+
+    pb_message(pp->sample, 1, pp->ids);
+    pb_message(pp->sample, 2, pp->values);
+    pb_message(pp->buf, 2, pp->sample);
+}
+
+static int
+pprof_location_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    pprof_t *pp = (pprof_t *)arg;
+    uint64_t id = ((frame_data_t *)val)->id;
+
+    pprof_location(pp, id, id, NUM2LONG(frame_first_lineno((VALUE)key)));
+    return ST_CONTINUE;
+}
+
+/* The Location of one line of a function, emitted when first sampled. */
+static uint64_t
+pprof_line_location(pprof_t *pp, st_table *locations, uint64_t function_id, int line, uint64_t *next)
+{
+    st_data_t key = (st_data_t)(function_id << 32 | (uint32_t)line), val;
+
+    if (st_lookup(locations, key, &val))
+	return (uint64_t)val;
+    val = (st_data_t)(*next)++;
+    pprof_location(pp, (uint64_t)val, function_id, line);
+    st_add_direct(locations, key, val);
+    return (uint64_t)val;
+}
+
+static VALUE
+pprof_gzip(VALUE data)
+{
+#ifdef HAVE_ZLIB_H
+    z_stream z;
+    VALUE out;
+    int ret;
+
+    MEMZERO(&z, z_stream, 1);
+    /* windowBits 15 + 16 selects the gzip wrapper */
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	rb_raise(rb_eRuntimeError, "deflateInit2 failed");
+
+    out = rb_str_new(0, deflateBound(&z, RSTRING_LEN(data)) + 32);
+    z.next_in = (Bytef *)RSTRING_PTR(data);
+    z.avail_in = (uInt)RSTRING_LEN(data);
+    z.next_out = (Bytef *)RSTRING_PTR(out);
+    z.avail_out = (uInt)RSTRING_LEN(out);
+    ret = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (ret != Z_STREAM_END)
+	rb_raise(rb_eRuntimeError, "deflate failed");
+
+    rb_str_resize(out, (long)z.total_out);
+    return out;
+#else
+    rb_raise(rb_eNotImpError, "pprof format requires zlib");
+#endif
+}
+
+static VALUE
+profile_pprof(profile_t *prof)
+{
+    pprof_t pp;
+    raw_iter_t it;
+    VALUE *sample;
+    size_t len, o;
+    int *lines;
+    uint64_t interval, id, next_location = (uint64_t)prof->frame_ids + 1;
+    st_table *locations = st_init_numtable();
+
+    pp.prof = prof;
+    pp.buf = rb_str_buf_new(4096);
+    pp.scratch = rb_str_buf_new(64);
+    pp.strings = rb_hash_new();
+    pp.string_table = rb_str_buf_new(4096);
+    pp.string_count = 0;
+    pp.sample = rb_str_buf_new(64);
+    pp.ids = rb_str_buf_new(256);
+    pp.values = rb_str_buf_new(16);
+    pprof_string(&pp, Qnil);
+
+    pprof_value_type(&pp, 1, "samples", "count");
+    if (prof->mode == sym_wall || prof->mode == sym_gvl)
+	pprof_value_type(&pp, 1, "wall", "nanoseconds");
+    else if (prof->mode == sym_cpu)
+	pprof_value_type(&pp, 1, "cpu", "nanoseconds");
+    else if (prof->mode == sym_object)
+	pprof_value_type(&pp, 1, "allocations", "count");
+
+    st_foreach(prof->frames, pprof_function_i, (st_data_t)&pp);
+    /* a frame's own id is its Location at the first line */
+    st_foreach(prof->frames, pprof_location_i, (st_data_t)&pp);
+
+    /*
+     * Only raw samples keep whole stacks: the aggregate edges say who
+     * called whom, not which chains occurred, so results() requires raw.
+     * Samples recorded with lines point at per-line Locations.
+     */
+    raw_iter_init(&it, &prof->raw_samples);
+    while ((sample = raw_samples_next(&it))) {
+	len = RAW_LEN(sample);
+	lines = RAW_LINES(sample);
+
+	/* raw stacks are stored root first; pprof wants the leaf first */
+	for (o = len; o > 0; o--) {
+	    id = frame_id(prof, sample[o]);
+	    if (lines && lines[o - 1] > 0)
+		id = pprof_line_location(&pp, locations, id, lines[o - 1], &next_location);
+	    pb_varint(pp.ids, id);
+	}
+	pprof_sample(&pp, (size_t)sample[len + 1]);
+    }
+    st_free_table(locations);
+
+    if (prof->mode == sym_wall || prof->mode == sym_cpu || prof->mode == sym_gvl) {
+	interval = NUM2ULL(prof->interval);
+	pprof_value_type(&pp, 11, prof->mode == sym_cpu ? "cpu" : "wall", "nanoseconds");
+	pb_uint(pp.buf, 12, interval * 1000);
+    } else if (prof->mode == sym_object) {
+	pprof_value_type(&pp, 11, "allocations", "count");
+	pb_uint(pp.buf, 12, NUM2ULL(prof->interval));
+    }
+
+    rb_str_buf_append(pp.buf, pp.string_table);
+    return pprof_gzip(pp.buf);
+}
+
+static void
+stackprofx_raw_free(void)
+{
+    raw_store_free(&_stackprofx.raw_samples);
+    raw_store_free(&_stackprofx.raw_timestamps);
+    _stackprofx.raw_sample_last = NULL;
+    _stackprofx.raw = 0;
+    _stackprofx.timestamps = 0;
+
+    if (_stackprofx.raw_fd >= 0) {
+	close(_stackprofx.raw_fd);
+	_stackprofx.raw_fd = -1;
+	_stackprofx.raw_file_len = 0;
+    }
+    if (_stackprofx.sample_threads) {
+	st_free_table(_stackprofx.sample_threads);
+	_stackprofx.sample_threads = NULL;
+    }
+}
+
+static void
+profile_free(profile_t *prof)
+{
+    if (prof->frames) {
+	st_foreach(prof->frames, frame_free_i, 0);
+	st_free_table(prof->frames);
+	prof->frames = NULL;
+    }
+    if (prof->frames_by_id) {
+	xfree(prof->frames_by_id);
+	prof->frames_by_id = NULL;
+    }
+    raw_store_free(&prof->raw_samples);
+    raw_store_free(&prof->raw_timestamps);
+    if (prof->raw_fd >= 0) {
+	close(prof->raw_fd);
+	prof->raw_fd = -1;
+    }
+    if (prof->sample_threads) {
+	st_free_table(prof->sample_threads);
+	prof->sample_threads = NULL;
+    }
+}
+
+static int
+fiber_frames_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct frame_details_arg *da = (struct frame_details_arg *)arg;
+    size_t half = (size_t)1<<(8*SIZEOF_SIZE_T/2);
+    size_t id, samples = val % half, total = val / half;
+    VALUE counts;
+
+    /* folded into (other) under max_memory after it was recorded */
+    if (!(id = frame_id(da->prof, (VALUE)key)))
+	id = frame_id(da->prof, FRAME_OTHER);
+    counts = rb_hash_aref(da->hash, SIZET2NUM(id));
+    if (NIL_P(counts)) {
+	counts = rb_hash_new();
+	rb_hash_aset(da->hash, SIZET2NUM(id), counts);
+    } else {
+	samples += NUM2SIZET(rb_hash_aref(counts, sym_samples));
+	total += NUM2SIZET(rb_hash_aref(counts, sym_total_samples));
+    }
+    rb_hash_aset(counts, sym_samples, SIZET2NUM(samples));
+    rb_hash_aset(counts, sym_total_samples, SIZET2NUM(total));
+    return ST_CONTINUE;
+}
+
+static int
+fiber_counts_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct frame_details_arg *da = (struct frame_details_arg *)arg;
+    struct frame_details_arg frames_arg;
+    fiber_count_t *fc = (fiber_count_t *)val;
+    VALUE details = rb_hash_new();
+
+    frames_arg.prof = da->prof;
+    frames_arg.hash = rb_hash_new();
+    if (fc->frames)
+	st_foreach(fc->frames, fiber_frames_i, (st_data_t)&frames_arg);
+
+    rb_hash_aset(details, sym_thread, rb_obj_id(fc->thread));
+    rb_hash_aset(details, sym_samples, SIZET2NUM(fc->samples));
+    rb_hash_aset(details, sym_suspended_samples, SIZET2NUM(fc->suspended));
+    rb_hash_aset(details, sym_frames, frames_arg.hash);
+    rb_hash_aset(da->hash, rb_obj_id((VALUE)key), details);
+    return ST_CONTINUE;
+}
+
+static int
+fiber_counts_free_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    fiber_count_t *fc = (fiber_count_t *)val;
+
+    if (fc->frames)
+	st_free_table(fc->frames);
+    xfree(fc);
+    return ST_CONTINUE;
+}
+
+struct gvl_wait_arg {
+    gvl_stack_t **stacks;
+    size_t len;
+};
+
+static int
+gvl_wait_collect_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct gvl_wait_arg *wa = (struct gvl_wait_arg *)arg;
+    gvl_stack_t *stack;
+
+    for (stack = (gvl_stack_t *)val; stack; stack = stack->next) {
+	if (wa->stacks)
+	    wa->stacks[wa->len] = stack;
+	wa->len++;
+    }
+    return ST_CONTINUE;
+}
+
+static int
+gvl_stack_cmp(const void *a, const void *b)
+{
+    size_t x = (*(gvl_stack_t * const *)a)->samples, y = (*(gvl_stack_t * const *)b)->samples;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Waiting stacks as [{frames: [id, ...], samples: n}], most waited on first. */
+static VALUE
+gvl_wait_stacks(profile_t *prof, st_table *waits)
+{
+    struct gvl_wait_arg wa = { NULL, 0 };
+    VALUE list, entry, frames;
+    size_t i, id;
+    int f;
+
+    st_foreach(waits, gvl_wait_collect_i, (st_data_t)&wa);
+    wa.stacks = ALLOC_N(gvl_stack_t *, wa.len ? wa.len : 1);
+    wa.len = 0;
+    st_foreach(waits, gvl_wait_collect_i, (st_data_t)&wa);
+    qsort(wa.stacks, wa.len, sizeof(gvl_stack_t *), gvl_stack_cmp);
+
+    list = rb_ary_new_capa(wa.len);
+    for (i = 0; i < wa.len; i++) {
+	frames = rb_ary_new_capa(wa.stacks[i]->num);
+	for (f = 0; f < wa.stacks[i]->num; f++) {
+	    /* folded into (other) under max_memory after it was recorded */
+	    if (!(id = frame_id(prof, wa.stacks[i]->frames[f])))
+		id = frame_id(prof, FRAME_OTHER);
+	    rb_ary_push(frames, SIZET2NUM(id));
+	}
+	entry = rb_hash_new();
+	rb_hash_aset(entry, sym_frames, frames);
+	rb_hash_aset(entry, sym_samples, SIZET2NUM(wa.stacks[i]->samples));
+	rb_ary_push(list, entry);
+	xfree(wa.stacks[i]);
+    }
+    xfree(wa.stacks);
+    return list;
+}
+
+/* Hand the sampler's finished profile over to prof. */
+static void
+stackprofx_detach(profile_t *prof)
+{
+    prof->mode = _stackprofx.mode;
+    prof->interval = _stackprofx.interval;
+    prof->overall_signals = _stackprofx.overall_signals;
+    prof->overall_samples = _stackprofx.overall_samples;
+    prof->during_gc = _stackprofx.during_gc;
+
+    prof->frames = _stackprofx.frames;
+    prof->frame_ids = _stackprofx.frame_ids;
+    prof->frames_by_id = NULL;
+    prof->raw = _stackprofx.raw;
+    prof->timestamps = _stackprofx.timestamps;
+    prof->raw_samples = _stackprofx.raw_samples;
+    prof->raw_timestamps = _stackprofx.raw_timestamps;
+    prof->raw_fd = _stackprofx.raw_fd;
+    prof->sample_threads = _stackprofx.sample_threads;
+
+    prof->extra = rb_hash_new();
+    rb_hash_aset(prof->extra, sym_sample_ticks, SIZET2NUM(_stackprofx.sample_ticks));
+    rb_hash_aset(prof->extra, sym_sampling_ns, ULL2NUM(_stackprofx.sampling_ns));
+    rb_hash_aset(prof->extra, sym_sampling_max_ns, ULL2NUM(_stackprofx.sampling_max_ns));
+    rb_hash_aset(prof->extra, sym_hot_allocations, SIZET2NUM(_stackprofx.hot_allocations));
+    if (_stackprofx.raw_dropped)
+	rb_hash_aset(prof->extra, sym_raw_dropped_samples, SIZET2NUM(_stackprofx.raw_dropped));
+    if (_stackprofx.max_memory) {
+	VALUE dropped = rb_hash_new();
+
+	rb_hash_aset(prof->extra, sym_max_memory, SIZET2NUM(_stackprofx.max_memory));
+	rb_hash_aset(prof->extra, sym_memory, SIZET2NUM(stackprofx_memsize()));
+	if (_stackprofx.lines_dropped)
+	    rb_hash_aset(dropped, sym_lines, Qtrue);
+	if (_stackprofx.raw_dropped_all)
+	    rb_hash_aset(dropped, sym_raw, Qtrue);
+	if (_stackprofx.folded_frames)
+	    rb_hash_aset(dropped, sym_folded_frames, SIZET2NUM(_stackprofx.folded_frames));
+	if (_stackprofx.shed_exhausted)
+	    rb_hash_aset(dropped, sym_exhausted, Qtrue);
+	rb_hash_aset(prof->extra, sym_dropped, dropped);
+    }
+    if (_stackprofx.method_granularity)
+	rb_hash_aset(prof->extra, sym_granularity, sym_method);
+    if (_stackprofx.external) {
+	VALUE external = rb_hash_new();
+
+	rb_hash_aset(prof->extra, sym_external, external);
+	rb_hash_aset(external, sym_samples, SIZET2NUM(_stackprofx.external_samples));
+	rb_hash_aset(external, sym_torn, SIZET2NUM(_stackprofx.external_torn));
+	rb_hash_aset(external, sym_invalid, SIZET2NUM(_stackprofx.external_invalid));
+	rb_hash_aset(external, sym_dropped, SIZET2NUM(_stackprofx.external_dropped));
+    }
+    if (_stackprofx.fiber_counts) {
+	struct frame_details_arg da;
+
+	da.prof = prof;
+	da.hash = rb_hash_new();
+	rb_hash_aset(prof->extra, sym_fibers, da.hash);
+	st_foreach(_stackprofx.fiber_counts, fiber_counts_i, (st_data_t)&da);
+	st_foreach(_stackprofx.fiber_counts, fiber_counts_free_i, 0);
+	st_free_table(_stackprofx.fiber_counts);
+	_stackprofx.fiber_counts = NULL;
+    }
+    if (_stackprofx.gvl_waits) {
+	VALUE states = rb_hash_new();
+
+	rb_hash_aset(prof->extra, sym_gvl_states, states);
+	rb_hash_aset(states, sym_holding, SIZET2NUM(_stackprofx.gvl_states[GVL_HOLDING]));
+	rb_hash_aset(states, sym_waiting, SIZET2NUM(_stackprofx.gvl_states[GVL_WAITING]));
+	rb_hash_aset(states, sym_blocked, SIZET2NUM(_stackprofx.gvl_states[GVL_BLOCKED]));
+	rb_hash_aset(states, sym_sleeping, SIZET2NUM(_stackprofx.gvl_states[GVL_SLEEPING]));
+	rb_hash_aset(prof->extra, sym_gvl_waiters, SIZET2NUM(_stackprofx.gvl_waiters));
+	rb_hash_aset(prof->extra, sym_gvl_wait_stacks, gvl_wait_stacks(prof, _stackprofx.gvl_waits));
+	st_free_table(_stackprofx.gvl_waits);
+	_stackprofx.gvl_waits = NULL;
+    }
+    if (_stackprofx.thread_stats) {
+	VALUE threads = rb_hash_new();
+
+	rb_hash_aset(prof->extra, sym_threads, threads);
+	st_foreach(_stackprofx.thread_stats, thread_stats_i, (st_data_t)threads);
+	st_free_table(_stackprofx.thread_stats);
+	_stackprofx.thread_stats = NULL;
+    }
+
+    _stackprofx.frames = NULL;
+    _stackprofx.grow_queue_len = 0;
+    MEMZERO(&_stackprofx.raw_samples, raw_store_t, 1);
+    MEMZERO(&_stackprofx.raw_timestamps, raw_store_t, 1);
+    _stackprofx.raw_sample_last = NULL;
+    _stackprofx.raw_fd = -1;
+    _stackprofx.raw_file_len = 0;
+    _stackprofx.sample_threads = NULL;
+    _stackprofx.raw = 0;
+    _stackprofx.timestamps = 0;
+}
+
+/*
+ * Folded stacks ("a;b;c 42"), one line per raw sample, for flamegraph.pl.
+ * Each frame name is resolved once and output is flushed to the IO in
+ * chunks, so memory stays flat however long the profile is.
+ */
+
+#define COLLAPSED_CHUNK (64 * 1024)
+
+static int
+collapsed_name_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    st_table *names = (st_table *)arg;
+    VALUE name = frame_full_label((VALUE)key);
+
+    char *p, *end;
+
+    if (NIL_P(name))
+	name = rb_str_new_cstr("(unknown)");
+    if (memchr(RSTRING_PTR(name), ';', RSTRING_LEN(name))) {
+	/* ';' separates frames; the cached name stays untouched */
+	name = rb_str_dup(name);
+	rb_str_modify(name);
+	for (p = RSTRING_PTR(name), end = p + RSTRING_LEN(name); p < end; p++)
+	    if (*p == ';')
+		*p = ':';
+    }
+    st_add_direct(names, key, (st_data_t)name);
+    return ST_CONTINUE;
+}
+
+static int
+collapsed_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    rb_ary_push((VALUE)arg, (VALUE)val);
+    return ST_CONTINUE;
+}
+
+static VALUE
+profile_collapsed(profile_t *prof, VALUE io)
+{
+    st_table *names = st_init_numtable_with_size(prof->frames->num_entries);
+    VALUE keep = rb_ary_new_capa(prof->frames->num_entries);
+    VALUE buf = rb_str_buf_new(COLLAPSED_CHUNK);
+    raw_iter_t it;
+    VALUE *sample;
+    size_t len, o;
+    st_data_t name;
+    char count[32];
+
+    st_foreach(prof->frames, collapsed_name_i, (st_data_t)names);
+    /* names are only referenced from the C table; keep them reachable */
+    st_foreach(names, collapsed_mark_i, (st_data_t)keep);
+
+    raw_iter_init(&it, &prof->raw_samples);
+    while ((sample = raw_samples_next(&it))) {
+	len = RAW_LEN(sample);
+
+	for (o = 1; o <= len; o++) {
+	    st_lookup(names, (st_data_t)sample[o], &name);
+	    if (o > 1)
+		rb_str_buf_cat(buf, ";", 1);
+	    rb_str_buf_append(buf, (VALUE)name);
+	}
+	snprintf(count, sizeof(count), " %lu\n", (unsigned long)sample[len + 1]);
+	rb_str_buf_cat2(buf, count);
+
+	if (!NIL_P(io) && RSTRING_LEN(buf) >= COLLAPSED_CHUNK) {
+	    rb_io_write(io, buf);
+	    rb_str_resize(buf, 0);
+	}
+    }
+
+    st_free_table(names);
+    RB_GC_GUARD(keep);
+
+    if (NIL_P(io))
+	return buf;
+    rb_io_write(io, buf);
+    return io;
+}
+
+static int
+sample_threads_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    rb_ary_store((VALUE)arg, (long)val, rb_obj_id((VALUE)key));
+    return ST_CONTINUE;
+}
+
+/*
+ * speedscope "sampled" export: one profile per thread. Each sample is
+ * weighted by the time until that thread's next sample, so the timeline
+ * keeps the gaps where the thread was not sampled.
+ */
+
+static void
+json_string(VALUE buf, VALUE str)
+{
+    const char *ptr;
+    long i, len;
+    char esc[8];
+
+    if (NIL_P(str)) {
+	rb_str_buf_cat2(buf, "null");
+	return;
+    }
+    ptr = RSTRING_PTR(str);
+    len = RSTRING_LEN(str);
+    rb_str_buf_cat(buf, "\"", 1);
+    for (i = 0; i < len; i++) {
+	unsigned char c = (unsigned char)ptr[i];
+	if (c == '"' || c == '\\') {
+	    esc[0] = '\\';
+	    esc[1] = c;
+	    rb_str_buf_cat(buf, esc, 2);
+	} else if (c < 0x20) {
+	    snprintf(esc, sizeof(esc), "\\u%04x", c);
+	    rb_str_buf_cat2(buf, esc);
+	} else {
+	    rb_str_buf_cat(buf, (const char *)&c, 1);
+	}
+    }
+    rb_str_buf_cat(buf, "\"", 1);
+}
+
+typedef struct {
+    VALUE samples;
+    VALUE weights;
+    VALUE *pending;	/* raw sample of the thread's previous sample */
+    uint64_t first;
+    uint64_t last;
+} speedscope_thread_t;
+
+struct speedscope_frames_arg {
+    VALUE buf;
+    st_table *index;
+};
+
+static int
+speedscope_frame_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct speedscope_frames_arg *fa = (struct speedscope_frames_arg *)arg;
+    VALUE frame = (VALUE)key;
+    VALUE file, line;
+    char num[32];
+
+    if (fa->index->num_entries > 0)
+	rb_str_buf_cat(fa->buf, ",", 1);
+    st_add_direct(fa->index, key, (st_data_t)fa->index->num_entries);
+
+    file = frame_path(frame);
+    line = frame_first_lineno(frame);
+
+    rb_str_buf_cat2(fa->buf, "{\"name\":");
+    json_string(fa->buf, frame_full_label(frame));
+    rb_str_buf_cat2(fa->buf, ",\"file\":");
+    json_string(fa->buf, file);
+    snprintf(num, sizeof(num), ",\"line\":%ld}", NUM2LONG(line));
+    rb_str_buf_cat2(fa->buf, num);
+    return ST_CONTINUE;
+}
+
+static void
+speedscope_emit(speedscope_thread_t *t, st_table *index, uint64_t weight)
+{
+    size_t len = (size_t)t->pending[0], o;
+    st_data_t idx;
+    char num[32];
+
+    rb_str_buf_cat(t->samples, RSTRING_LEN(t->samples) ? ",[" : "[", RSTRING_LEN(t->samples) ? 2 : 1);
+    for (o = 1; o <= len; o++) {
+	st_lookup(index, (st_data_t)t->pending[o], &idx);
+	snprintf(num, sizeof(num), o > 1 ? ",%lu" : "%lu", (unsigned long)idx);
+	rb_str_buf_cat2(t->samples, num);
+    }
+    rb_str_buf_cat(t->samples, "]", 1);
+
+    snprintf(num, sizeof(num), RSTRING_LEN(t->weights) ? ",%lu" : "%lu", (unsigned long)weight);
+    rb_str_buf_cat2(t->weights, num);
+}
+
+static VALUE
+profile_speedscope(profile_t *prof)
+{
+    struct speedscope_frames_arg fa;
+    speedscope_thread_t *threads;
+    size_t nthreads = prof->sample_threads->num_entries, i, w, len;
+    raw_iter_t it, ts;
+    VALUE *sample;
+    uint64_t now = 0, delta, thread, interval;
+    VALUE buf = rb_str_buf_new(4096), keep = rb_ary_new(), thread_ids;
+    char num[64];
+
+    interval = NIL_P(prof->interval) ? 1 : NUM2ULL(prof->interval);
+    thread_ids = rb_ary_new_capa(nthreads);
+    st_foreach(prof->sample_threads, sample_threads_i, (st_data_t)thread_ids);
+
+    rb_str_buf_cat2(buf, "{\"$schema\":\"https://www.speedscope.app/file-format-schema.json\",");
+    rb_str_buf_cat2(buf, "\"exporter\":\"stackprofx\",\"shared\":{\"frames\":[");
+    fa.buf = buf;
+    fa.index = st_init_numtable_with_size(prof->frames->num_entries);
+    st_foreach(prof->frames, speedscope_frame_i, (st_data_t)&fa);
+    rb_str_buf_cat2(buf, "]},\"profiles\":[");
+
+    threads = ALLOC_N(speedscope_thread_t, nthreads);
+    for (i = 0; i < nthreads; i++) {
+	threads[i].samples = rb_str_buf_new(256);
+	threads[i].weights = rb_str_buf_new(64);
+	threads[i].pending = NULL;
+	threads[i].first = threads[i].last = 0;
+	rb_ary_push(keep, threads[i].samples);
+	rb_ary_push(keep, threads[i].weights);
+    }
+
+    raw_iter_init(&it, &prof->raw_samples);
+    raw_iter_init(&ts, &prof->raw_timestamps);
+    while ((sample = raw_samples_next(&it))) {
+	len = RAW_LEN(sample);
+	for (w = (size_t)sample[len + 1]; w > 0; w--) {
+	    speedscope_thread_t *t;
+
+	    if (!raw_timestamps_next(&ts, &delta, &thread))
+		break;
+	    now += delta;
+	    /* a damaged raw file must not index past the thread list */
+	    if (thread >= nthreads)
+		continue;
+	    t = &threads[thread];
+	    if (t->pending)
+		speedscope_emit(t, fa.index, now - t->last);
+	    else
+		t->first = now;
+	    t->pending = sample;
+	    t->last = now;
+	}
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	speedscope_thread_t *t = &threads[i];
+	if (t->pending)
+	    speedscope_emit(t, fa.index, interval);
+
+	if (i > 0)
+	    rb_str_buf_cat(buf, ",", 1);
+	snprintf(num, sizeof(num), "{\"type\":\"sampled\",\"name\":\"Thread %ld\",", NUM2LONG(rb_ary_entry(thread_ids, (long)i)));
+	rb_str_buf_cat2(buf, num);
+	rb_str_buf_cat2(buf, "\"unit\":\"microseconds\",");
+	snprintf(num, sizeof(num), "\"startValue\":%lu,\"endValue\":%lu,", (unsigned long)t->first, (unsigned long)(t->last + interval));
+	rb_str_buf_cat2(buf, num);
+	rb_str_buf_cat2(buf, "\"samples\":[");
+	rb_str_buf_append(buf, t->samples);
+	rb_str_buf_cat2(buf, "],\"weights\":[");
+	rb_str_buf_append(buf, t->weights);
+	rb_str_buf_cat2(buf, "]}");
+    }
+    rb_str_buf_cat2(buf, "]}");
+
+    xfree(threads);
+    st_free_table(fa.index);
+    RB_GC_GUARD(keep);
+    return buf;
+}
+
+static int
+hash_update_i(VALUE key, VALUE val, VALUE arg)
+{
+    rb_hash_aset(arg, key, val);
+    return ST_CONTINUE;
+}
+
+static VALUE
+profile_to_h(profile_t *prof)
+{
+    VALUE results, frames;
+    struct frame_details_arg da;
+
+    results = rb_hash_new();
+    rb_hash_aset(results, sym_version, DBL2NUM(1.1));
+    rb_hash_aset(results, sym_mode, prof->mode);
+    rb_hash_aset(results, sym_interval, prof->interval);
+    rb_hash_aset(results, sym_samples, SIZET2NUM(prof->overall_samples));
+    rb_hash_aset(results, sym_gc_samples, SIZET2NUM(prof->during_gc));
+    rb_hash_aset(results, sym_missed_samples, SIZET2NUM(prof->overall_signals - prof->overall_samples));
+    rb_hash_foreach(prof->extra, hash_update_i, results);
+
+    frames = rb_hash_new();
+    rb_hash_aset(results, sym_frames, frames);
+    da.prof = prof;
+    da.hash = frames;
+    st_foreach(prof->frames, frame_i, (st_data_t)&da);
+
+    if (prof->raw && prof->raw_samples.len) {
+	size_t len, o;
+	raw_iter_t it;
+	VALUE *sample;
+	VALUE raw_samples = rb_ary_new_capa(prof->raw_samples.len / sizeof(VALUE));
+
+	raw_iter_init(&it, &prof->raw_samples);
+	while ((sample = raw_samples_next(&it))) {
+	    len = RAW_LEN(sample);
+	    rb_ary_push(raw_samples, SIZET2NUM(len));
+
+	    for (o = 1; o <= len; o++)
+		rb_ary_push(raw_samples, SIZET2NUM(frame_id(prof, sample[o])));
+	    rb_ary_push(raw_samples, SIZET2NUM((size_t)sample[len + 1]));
+	}
+
+	rb_hash_aset(results, sym_raw, raw_samples);
+
+	if (prof->timestamps) {
+	    VALUE deltas = rb_ary_new(), threads = rb_ary_new();
+	    VALUE thread_ids = rb_ary_new_capa(prof->sample_threads->num_entries);
+	    uint64_t delta, thread;
+
+	    raw_iter_init(&it, &prof->raw_timestamps);
+	    while (raw_timestamps_next(&it, &delta, &thread)) {
+		rb_ary_push(deltas, ULL2NUM(delta));
+		rb_ary_push(threads, ULL2NUM(thread));
+	    }
+	    st_foreach(prof->sample_threads, sample_threads_i, (st_data_t)thread_ids);
+
+	    rb_hash_aset(results, sym_raw_timestamp_deltas, deltas);
+	    rb_hash_aset(results, sym_raw_sample_threads, threads);
+	    rb_hash_aset(results, sym_sample_threads, thread_ids);
+	}
+    }
+
+    return results;
+}
+
+/*
+ * StackProfx::Profile
+ */
+
+static VALUE cProfile;
+
+static void
+profile_mark(void *ptr)
+{
+    profile_t *prof = ptr;
+
+    if (!prof)
+	return;
+    rb_gc_mark(prof->mode);
+    rb_gc_mark(prof->interval);
+    rb_gc_mark(prof->extra);
+    if (prof->frames)
+	st_foreach(prof->frames, frame_mark_i, 0);
+    if (prof->sample_threads)
+	st_foreach(prof->sample_threads, frame_mark_i, 0);
+}
+
+static void
+profile_dealloc(void *ptr)
+{
+    if (ptr) {
+	profile_free(ptr);
+	xfree(ptr);
+    }
+}
+
+static size_t
+profile_memsize(const void *ptr)
+{
+    const profile_t *prof = ptr;
+    return prof ? sizeof(profile_t) + prof->raw_samples.mapped + prof->raw_timestamps.mapped : 0;
+}
+
+static const rb_data_type_t profile_data_type = {
+    "StackProfx::Profile",
+    { profile_mark, profile_dealloc, profile_memsize, },
+};
+
+/* The object owns the profile from the start, so its frames stay marked. */
+static VALUE
+profile_new(void)
+{
+    VALUE obj = TypedData_Wrap_Struct(cProfile, &profile_data_type, 0);
+    profile_t *prof = ALLOC(profile_t);
+
+    MEMZERO(prof, profile_t, 1);
+    prof->mode = prof->interval = prof->extra = Qnil;
+    prof->raw_fd = -1;
+    DATA_PTR(obj) = prof;
+    stackprofx_detach(prof);
+    return obj;
+}
+
+static profile_t *
+profile_get(VALUE self)
+{
+    profile_t *prof;
+
+    TypedData_Get_Struct(self, profile_t, &profile_data_type, prof);
+    if (!prof->frames)
+	rb_raise(rb_eRuntimeError, "profile has been released");
+    return prof;
+}
+
+static VALUE
+profile_to_h_m(VALUE self)
+{
+    return profile_to_h(profile_get(self));
+}
+
+static VALUE
+profile_size(VALUE self)
+{
+    return SIZET2NUM(profile_get(self)->frames->num_entries);
+}
+
+static int
+frames_by_id_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    st_data_t *by_id = (st_data_t *)arg;
+    by_id[((frame_data_t *)val)->id] = key;
+    return ST_CONTINUE;
+}
+
+/* Frame key and data for a frame id; the id index is built on first use. */
+static int
+profile_frame_lookup(profile_t *prof, VALUE id, st_data_t *key, st_data_t *val)
+{
+    size_t n = NUM2SIZET(id);
+
+    if (!prof->frames_by_id) {
+	prof->frames_by_id = ALLOC_N(st_data_t, prof->frame_ids + 1);
+	MEMZERO(prof->frames_by_id, st_data_t, prof->frame_ids + 1);
+	st_foreach(prof->frames, frames_by_id_i, (st_data_t)prof->frames_by_id);
+    }
+    if (n == 0 || n > prof->frame_ids)
+	return 0;
+    *key = prof->frames_by_id[n];
+    return st_lookup(prof->frames, *key, val);
+}
+
+static VALUE
+profile_frame(VALUE self, VALUE id)
+{
+    profile_t *prof = profile_get(self);
+    st_data_t key, val;
+
+    if (!profile_frame_lookup(prof, id, &key, &val))
+	return Qnil;
+    return frame_details(prof, (VALUE)key, (frame_data_t *)val);
+}
+
+/* top(n): a min-heap of the n best frames seen so far */
+
+typedef struct {
+    size_t value;
+    st_data_t key;
+    frame_data_t *frame_data;
+} top_entry_t;
+
+struct top_arg {
+    top_entry_t *heap;
+    long len;
+    long capa;
+    int by_total;
+};
+
+static void
+top_sift_down(top_entry_t *heap, long len, long i)
+{
+    for (;;) {
+	long l = 2 * i + 1, r = l + 1, min = i;
+	top_entry_t tmp;
+
+	if (l < len && heap[l].value < heap[min].value) min = l;
+	if (r < len && heap[r].value < heap[min].value) min = r;
+	if (min == i)
+	    return;
+	tmp = heap[i];
+	heap[i] = heap[min];
+	heap[min] = tmp;
+	i = min;
+    }
+}
+
+static int
+top_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct top_arg *ta = (struct top_arg *)arg;
+    frame_data_t *frame_data = (frame_data_t *)val;
+    top_entry_t entry;
+    long i;
+
+    entry.value = ta->by_total ? frame_data->total_samples : frame_data->caller_samples;
+    entry.key = key;
+    entry.frame_data = frame_data;
+
+    if (ta->len < ta->capa) {
+	/* sift up */
+	for (i = ta->len++; i > 0 && ta->heap[(i - 1) / 2].value > entry.value; i = (i - 1) / 2)
+	    ta->heap[i] = ta->heap[(i - 1) / 2];
+	ta->heap[i] = entry;
+    } else if (entry.value > ta->heap[0].value) {
+	ta->heap[0] = entry;
+	top_sift_down(ta->heap, ta->len, 0);
+    }
+    return ST_CONTINUE;
+}
+
+static VALUE
+profile_top(int argc, VALUE *argv, VALUE self)
+{
+    profile_t *prof = profile_get(self);
+    VALUE n = Qnil, opts = Qnil, by = Qnil, top;
+    struct top_arg ta;
+    long i;
+
+    rb_scan_args(argc, argv, "01:", &n, &opts);
+    if (RTEST(opts))
+	by = rb_hash_aref(opts, ID2SYM(rb_intern("by")));
+    if (!NIL_P(by) && by != sym_samples && by != sym_total_samples)
+	rb_raise(rb_eArgError, "by: must be :samples or :total_samples");
+
+    ta.capa = NIL_P(n) ? 10 : NUM2LONG(n);
+    if (ta.capa < 0)
+	rb_raise(rb_eArgError, "negative count");
+    ta.len = 0;
+    ta.by_total = by == sym_total_samples;
+    ta.heap = ALLOC_N(top_entry_t, ta.capa ? ta.capa : 1);
+    if (ta.capa)
+	st_foreach(prof->frames, top_i, (st_data_t)&ta);
+
+    /* pop the heap smallest first, filling the result from the back */
+    top = rb_ary_new2(ta.len);
+    for (i = ta.len - 1; i >= 0; i--) {
+	top_entry_t entry = ta.heap[0];
+	ta.heap[0] = ta.heap[i];
+	top_sift_down(ta.heap, i, 0);
+	rb_ary_store(top, i, rb_assoc_new(SIZET2NUM(entry.frame_data->id),
+					  frame_details(prof, (VALUE)entry.key, entry.frame_data)));
+    }
+    xfree(ta.heap);
+    return top;
+}
+
+/*
+ * Call trees, built from the raw stacks: call_tree walks callees down from a
+ * root (or from every stack's outermost frame), callers walks up from a
+ * frame's innermost occurrence. total_samples is inclusive, samples is
+ * exclusive (for callers: the frame's own samples that came through that
+ * path).
+ */
+
+typedef struct call_node {
+    VALUE frame;
+    size_t total;
+    size_t self;
+    st_table *children;
+} call_node_t;
+
+struct call_tree_arg {
+    profile_t *prof;
+    st_table *focus;
+    st_table *ignore;
+    double threshold;
+    size_t min;
+};
+
+static call_node_t *
+call_node_new(VALUE frame)
+{
+    call_node_t *node = ALLOC(call_node_t);
+
+    node->frame = frame;
+    node->total = node->self = 0;
+    node->children = NULL;
+    return node;
+}
+
+static call_node_t *
+call_node_child(call_node_t *node, VALUE frame)
+{
+    st_data_t val;
+
+    if (!node->children)
+	node->children = st_init_numtable();
+    if (!st_lookup(node->children, (st_data_t)frame, &val)) {
+	val = (st_data_t)call_node_new(frame);
+	st_add_direct(node->children, (st_data_t)frame, val);
+    }
+    return (call_node_t *)val;
+}
+
+static int
+call_node_free_i(st_data_t key, st_data_t val, st_data_t arg);
+
+static void
+call_node_free(call_node_t *node)
+{
+    if (node->children) {
+	st_foreach(node->children, call_node_free_i, 0);
+	st_free_table(node->children);
+    }
+    xfree(node);
+}
+
+static int
+call_node_free_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    call_node_free((call_node_t *)val);
+    return ST_CONTINUE;
+}
+
+struct call_children {
+    call_node_t **nodes;
+    long len;
+    size_t min;
+};
+
+static int
+call_children_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct call_children *cc = (struct call_children *)arg;
+    call_node_t *node = (call_node_t *)val;
+
+    if (node->total >= cc->min)
+	cc->nodes[cc->len++] = node;
+    return ST_CONTINUE;
+}
+
+static int
+call_node_cmp(const void *a, const void *b)
+{
+    size_t x = (*(call_node_t **)a)->total, y = (*(call_node_t **)b)->total;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static VALUE
+call_node_to_h(struct call_tree_arg *ta, call_node_t *node)
+{
+    VALUE hash = rb_hash_new(), children;
+    struct call_children cc;
+    long i;
+
+    if (node->frame == Qundef) {
+	rb_hash_aset(hash, sym_id, Qnil);
+	rb_hash_aset(hash, sym_name, rb_str_new_cstr("(root)"));
+    } else {
+	rb_hash_aset(hash, sym_id, SIZET2NUM(frame_id(ta->prof, node->frame)));
+	rb_hash_aset(hash, sym_name, frame_full_label(node->frame));
+    }
+    rb_hash_aset(hash, sym_total_samples, SIZET2NUM(node->total));
+    rb_hash_aset(hash, sym_samples, SIZET2NUM(node->self));
+
+    children = rb_ary_new();
+    rb_hash_aset(hash, sym_children, children);
+    if (!node->children)
+	return hash;
+
+    cc.nodes = ALLOC_N(call_node_t *, node->children->num_entries);
+    cc.len = 0;
+    cc.min = ta->min;
+    st_foreach(node->children, call_children_i, (st_data_t)&cc);
+    qsort(cc.nodes, cc.len, sizeof(call_node_t *), call_node_cmp);
+    for (i = 0; i < cc.len; i++)
+	rb_ary_push(children, call_node_to_h(ta, cc.nodes[i]));
+    xfree(cc.nodes);
+    return hash;
+}
+
+/* Frame keys for an id or array of ids, or NULL when none were given. */
+static st_table *
+call_tree_frames(profile_t *prof, VALUE ids)
+{
+    st_table *frames;
+    st_data_t key, val;
+    long i;
+
+    if (NIL_P(ids))
+	return NULL;
+    ids = rb_Array(ids);
+    frames = st_init_numtable();
+    for (i = 0; i < RARRAY_LEN(ids); i++) {
+	if (profile_frame_lookup(prof, RARRAY_AREF(ids, i), &key, &val))
+	    st_insert(frames, key, 0);
+    }
+    return frames;
+}
+
+static int
+call_tree_keep(struct call_tree_arg *ta, VALUE *stack, size_t len)
+{
+    size_t i;
+    int focused = !ta->focus;
+
+    for (i = 0; i < len; i++) {
+	if (ta->ignore && st_lookup(ta->ignore, (st_data_t)stack[i], 0))
+	    return 0;
+	if (!focused && st_lookup(ta->focus, (st_data_t)stack[i], 0))
+	    focused = 1;
+    }
+    return focused;
+}
+
+/* Parses (id = nil, threshold:, focus:, ignore:); returns the root frame key. */
+static st_data_t
+call_tree_args(int argc, VALUE *argv, profile_t *prof, struct call_tree_arg *ta, int need_id)
+{
+    VALUE id = Qnil, opts = Qnil, threshold = Qnil, focus = Qnil, ignore = Qnil;
+    st_data_t key = (st_data_t)Qundef, val;
+
+    rb_scan_args(argc, argv, need_id ? "1:" : "01:", &id, &opts);
+    if (!prof->raw || !prof->raw_samples.len)
+	rb_raise(rb_eRuntimeError, "call trees need raw samples (start with raw: true)");
+    if (!NIL_P(id) && !profile_frame_lookup(prof, id, &key, &val))
+	rb_raise(rb_eArgError, "unknown frame id");
+    if (RTEST(opts)) {
+	threshold = rb_hash_aref(opts, sym_threshold);
+	focus = rb_hash_aref(opts, sym_focus);
+	ignore = rb_hash_aref(opts, sym_ignore);
+    }
+    ta->prof = prof;
+    ta->threshold = NIL_P(threshold) ? 0.0 : NUM2DBL(threshold);
+    ta->focus = call_tree_frames(prof, focus);
+    ta->ignore = call_tree_frames(prof, ignore);
+    return key;
+}
+
+static VALUE
+call_tree_finish(struct call_tree_arg *ta, call_node_t *root)
+{
+    VALUE tree;
+
+    /* threshold is a fraction of the root's samples */
+    ta->min = (size_t)(ta->threshold * (double)root->total + 0.5);
+    tree = call_node_to_h(ta, root);
+    call_node_free(root);
+    if (ta->focus) st_free_table(ta->focus);
+    if (ta->ignore) st_free_table(ta->ignore);
+    return tree;
+}
+
+static VALUE
+profile_call_tree(int argc, VALUE *argv, VALUE self)
+{
+    profile_t *prof = profile_get(self);
+    struct call_tree_arg ta;
+    call_node_t *root, *node;
+    raw_iter_t it;
+    VALUE *sample;
+    size_t len, weight, i;
+
+    root = call_node_new((VALUE)call_tree_args(argc, argv, prof, &ta, 0));
+
+    raw_iter_init(&it, &prof->raw_samples);
+    while ((sample = raw_samples_next(&it))) {
+	len = RAW_LEN(sample);
+	weight = (size_t)sample[len + 1];
+	if (!call_tree_keep(&ta, sample + 1, len))
+	    continue;
+
+	if (root->frame == Qundef) {
+	    i = 0;
+	} else {
+	    for (i = 0; i < len && sample[i + 1] != root->frame; i++);
+	    if (i == len)
+		continue;
+	    i++;
+	}
+
+	node = root;
+	node->total += weight;
+	for (; i < len; i++) {
+	    node = call_node_child(node, sample[i + 1]);
+	    node->total += weight;
+	}
+	node->self += weight;
+    }
+
+    return call_tree_finish(&ta, root);
+}
+
+static VALUE
+profile_callers(int argc, VALUE *argv, VALUE self)
+{
+    profile_t *prof = profile_get(self);
+    struct call_tree_arg ta;
+    call_node_t *root, *node;
+    raw_iter_t it;
+    VALUE *sample;
+    size_t len, weight, i, leaf;
+
+    root = call_node_new((VALUE)call_tree_args(argc, argv, prof, &ta, 1));
+
+    raw_iter_init(&it, &prof->raw_samples);
+    while ((sample = raw_samples_next(&it))) {
+	len = RAW_LEN(sample);
+	weight = (size_t)sample[len + 1];
+	if (!call_tree_keep(&ta, sample + 1, len))
+	    continue;
+
+	for (i = len; i > 0 && sample[i] != root->frame; i--);
+	if (i == 0)
+	    continue;
+	leaf = i == len ? weight : 0;
+
+	node = root;
+	node->total += weight;
+	node->self += leaf;
+	while (--i > 0) {
+	    node = call_node_child(node, sample[i]);
+	    node->total += weight;
+	    node->self += leaf;
+	}
+    }
+
+    return call_tree_finish(&ta, root);
+}
+
+static VALUE
+stackprofx_results(int argc, VALUE *argv, VALUE self)
+{
+    VALUE results, profile, out = Qnil, opts = Qnil, format = Qnil;
+    profile_t *prof;
+
+    if (!_stackprofx.frames || _stackprofx.running)
+	return Qnil;
+
+    rb_scan_args(argc, argv, "01:", &out, &opts);
+    if (RTEST(opts))
+	format = rb_hash_aref(opts, sym_format);
+    if (!NIL_P(format) && format != sym_hash && format != sym_profile &&
+	format != sym_pprof && format != sym_collapsed && format != sym_speedscope)
+	rb_raise(rb_eArgError, "unknown results format");
+    if (format == sym_speedscope && !_stackprofx.timestamps)
+	rb_raise(rb_eArgError, "speedscope format requires timestamps: true");
+    if (format == sym_collapsed && !_stackprofx.raw)
+	rb_raise(rb_eArgError, "collapsed format requires raw: true");
+    if (format == sym_pprof && !_stackprofx.raw)
+	rb_raise(rb_eArgError, "pprof format requires raw: true");
+#ifndef HAVE_ZLIB_H
+    /* checked before the profile is detached, so the data is not lost */
+    if (format == sym_pprof)
+	rb_raise(rb_eNotImpError, "pprof format requires zlib");
+#endif
+    if (!NIL_P(out))
+	_stackprofx.out = out;
+
+    profile = profile_new();
+    if (format == sym_profile)
+	return profile;
+    prof = DATA_PTR(profile);
+
+    if (format == sym_collapsed) {
+	VALUE file = Qnil;
+	if (RTEST(_stackprofx.out))
+	    file = stackprofx_out_file("w");
+	results = profile_collapsed(prof, file);
+	profile_free(prof);
+	if (!NIL_P(file)) {
+	    rb_io_flush(file);
+	    _stackprofx.out = Qnil;
+	}
+	return results;
+    }
+
+    if (format == sym_pprof)
+	results = profile_pprof(prof);
+    else if (format == sym_speedscope)
+	results = profile_speedscope(prof);
+    else
+	results = profile_to_h(prof);
+    profile_free(prof);
+
+    RB_GC_GUARD(profile);
+    return stackprofx_write_results(results, format);
+}
+
+/*
+ * Profile merging. Frames are identified across profiles by (file, name,
+ * first line) and renumbered densely; each input is folded into the merged
+ * profile and dropped before the next is loaded, so memory grows with the
+ * number of unique frames and unique raw stacks, not with the number of
+ * inputs. Edges and raw stacks that refer to a frame id the input does not
+ * list are skipped.
+ */
+
+typedef struct {
+    VALUE result;
+    VALUE frames;
+    VALUE identities;	/* [file, name, line] => merged id */
+    VALUE stacks;	/* raw stack of merged ids => summed weight */
+    VALUE map;		/* input frame id => merged id, per input */
+    VALUE details;	/* merged details of the frame being merged */
+} merge_t;
+
+static VALUE
+merge_frame_identity(VALUE frame)
+{
+    VALUE key = rb_ary_new_capa(3);
+
+    rb_ary_push(key, rb_hash_aref(frame, sym_file));
+    rb_ary_push(key, rb_hash_aref(frame, sym_name));
+    rb_ary_push(key, rb_hash_aref(frame, sym_line));
+    return rb_obj_freeze(key);
+}
+
+static void
+merge_add(VALUE hash, VALUE key, VALUE value)
+{
+    VALUE current = rb_hash_aref(hash, key);
+
+    if (NIL_P(value))
+	return;
+    if (NIL_P(current))
+	rb_hash_aset(hash, key, value);
+    else
+	rb_hash_aset(hash, key, rb_funcall(current, '+', 1, value));
+}
+
+static int
+merge_frame_i(VALUE id, VALUE frame, VALUE arg)
+{
+    merge_t *m = (merge_t *)arg;
+    VALUE identity = merge_frame_identity(frame);
+    VALUE merged_id = rb_hash_lookup2(m->identities, identity, Qundef);
+    VALUE details;
+
+    if (merged_id == Qundef) {
+	merged_id = LONG2NUM(RHASH_SIZE(m->identities) + 1);
+	rb_hash_aset(m->identities, identity, merged_id);
+
+	details = rb_hash_new();
+	rb_hash_aset(details, sym_name, rb_hash_aref(frame, sym_name));
+	rb_hash_aset(details, sym_file, rb_hash_aref(frame, sym_file));
+	if (!NIL_P(rb_hash_aref(frame, sym_line)))
+	    rb_hash_aset(details, sym_line, rb_hash_aref(frame, sym_line));
+	rb_hash_aset(details, sym_total_samples, INT2FIX(0));
+	rb_hash_aset(details, sym_samples, INT2FIX(0));
+	rb_hash_aset(m->frames, merged_id, details);
+    } else {
+	details = rb_hash_aref(m->frames, merged_id);
+    }
+
+    merge_add(details, sym_total_samples, rb_hash_aref(frame, sym_total_samples));
+    merge_add(details, sym_samples, rb_hash_aref(frame, sym_samples));
+    rb_hash_aset(m->map, id, merged_id);
+    return ST_CONTINUE;
+}
+
+static int
+merge_edge_i(VALUE id, VALUE weight, VALUE arg)
+{
+    merge_t *m = (merge_t *)arg;
+    VALUE edges = rb_hash_aref(m->details, sym_edges);
+    VALUE merged_id = rb_hash_aref(m->map, id);
+
+    if (NIL_P(merged_id))
+	return ST_CONTINUE;
+    if (NIL_P(edges)) {
+	edges = rb_hash_new();
+	rb_hash_aset(m->details, sym_edges, edges);
+    }
+    merge_add(edges, merged_id, weight);
+    return ST_CONTINUE;
+}
+
+static int
+merge_line_i(VALUE line, VALUE counts, VALUE arg)
+{
+    merge_t *m = (merge_t *)arg;
+    VALUE lines = rb_hash_aref(m->details, sym_lines);
+    VALUE current;
+
+    if (NIL_P(lines)) {
+	lines = rb_hash_new();
+	rb_hash_aset(m->details, sym_lines, lines);
+    }
+    current = rb_hash_aref(lines, line);
+    if (NIL_P(current)) {
+	rb_hash_aset(lines, line, rb_ary_dup(counts));
+    } else {
+	rb_ary_store(current, 0, rb_funcall(rb_ary_entry(current, 0), '+', 1, rb_ary_entry(counts, 0)));
+	rb_ary_store(current, 1, rb_funcall(rb_ary_entry(current, 1), '+', 1, rb_ary_entry(counts, 1)));
+    }
+    return ST_CONTINUE;
+}
+
+static int
+merge_frame_tables_i(VALUE id, VALUE frame, VALUE arg)
+{
+    merge_t *m = (merge_t *)arg;
+    VALUE edges = rb_hash_aref(frame, sym_edges);
+    VALUE lines = rb_hash_aref(frame, sym_lines);
+
+    m->details = rb_hash_aref(m->frames, rb_hash_aref(m->map, id));
+    if (RB_TYPE_P(edges, T_HASH))
+	rb_hash_foreach(edges, merge_edge_i, arg);
+    if (RB_TYPE_P(lines, T_HASH))
+	rb_hash_foreach(lines, merge_line_i, arg);
+    return ST_CONTINUE;
+}
+
+static void
+merge_profile(merge_t *m, VALUE profile)
+{
+    VALUE frames, raw, stack, id;
+    long n, o, len;
+
+    Check_Type(profile, T_HASH);
+
+    if (NIL_P(m->result)) {
+	m->result = rb_hash_new();
+	rb_hash_aset(m->result, sym_version, rb_hash_aref(profile, sym_version));
+	rb_hash_aset(m->result, sym_mode, rb_hash_aref(profile, sym_mode));
+	rb_hash_aset(m->result, sym_interval, rb_hash_aref(profile, sym_interval));
+	rb_hash_aset(m->result, sym_frames, m->frames);
+    } else if (!rb_equal(rb_hash_aref(m->result, sym_mode), rb_hash_aref(profile, sym_mode))) {
+	rb_raise(rb_eArgError, "cannot merge profiles of different modes");
+    } else if (!rb_equal(rb_hash_aref(m->result, sym_interval), rb_hash_aref(profile, sym_interval))) {
+	/* a sample would stand for a different amount of time or allocations */
+	rb_raise(rb_eArgError, "cannot merge profiles of different intervals");
+    }
+
+    merge_add(m->result, sym_samples, rb_hash_aref(profile, sym_samples));
+    merge_add(m->result, sym_gc_samples, rb_hash_aref(profile, sym_gc_samples));
+    merge_add(m->result, sym_missed_samples, rb_hash_aref(profile, sym_missed_samples));
+
+    m->map = rb_hash_new();
+    frames = rb_hash_aref(profile, sym_frames);
+    if (RB_TYPE_P(frames, T_HASH)) {
+	rb_hash_foreach(frames, merge_frame_i, (VALUE)m);
+	rb_hash_foreach(frames, merge_frame_tables_i, (VALUE)m);
+    }
+
+    raw = rb_hash_aref(profile, sym_raw);
+    if (RB_TYPE_P(raw, T_ARRAY)) {
+	if (NIL_P(m->stacks))
+	    m->stacks = rb_hash_new();
+	for (n = 0; n + 1 < RARRAY_LEN(raw); n += len + 2) {
+	    len = NUM2LONG(RARRAY_AREF(raw, n));
+	    if (n + len + 1 >= RARRAY_LEN(raw))
+		rb_raise(rb_eArgError, "truncated raw stack");
+	    stack = rb_ary_new_capa(len);
+	    for (o = 1; o <= len; o++) {
+		if (NIL_P(id = rb_hash_aref(m->map, RARRAY_AREF(raw, n + o))))
+		    break;
+		rb_ary_push(stack, id);
+	    }
+	    if (o <= len)
+		continue;
+	    merge_add(m->stacks, rb_obj_freeze(stack), RARRAY_AREF(raw, n + len + 1));
+	}
+    }
+}
+
+static int
+merge_stack_i(VALUE stack, VALUE weight, VALUE raw)
+{
+    rb_ary_push(raw, LONG2NUM(RARRAY_LEN(stack)));
+    rb_ary_concat(raw, stack);
+    rb_ary_push(raw, weight);
+    return ST_CONTINUE;
+}
+
+/* A results hash from a hash, a Profile or the path of a Marshal dump. */
+static VALUE
+profile_load(VALUE input)
+{
+    if (RB_TYPE_P(input, T_STRING)) {
+	VALUE file = rb_file_open_str(input, "rb");
+	VALUE profile = rb_marshal_load(file);
+	rb_io_close(file);
+	return profile;
+    }
+    if (rb_typeddata_is_kind_of(input, &profile_data_type))
+	return profile_to_h(profile_get(input));
+    return input;
+}
+
+static VALUE
+stackprofx_merge(VALUE self, VALUE inputs)
+{
+    merge_t m;
+    long i;
+
+    inputs = rb_Array(inputs);
+    m.result = Qnil;
+    m.frames = rb_hash_new();
+    m.identities = rb_hash_new();
+    m.stacks = Qnil;
+    m.map = Qnil;
+    m.details = Qnil;
+
+    for (i = 0; i < RARRAY_LEN(inputs); i++)
+	merge_profile(&m, profile_load(RARRAY_AREF(inputs, i)));
+
+    if (!NIL_P(m.stacks)) {
+	VALUE raw = rb_ary_new();
+
+	rb_hash_foreach(m.stacks, merge_stack_i, raw);
+	rb_hash_aset(m.result, sym_raw, raw);
+    }
+    return m.result;
+}
+
+/*
+ * Profile diffing. Frames (and their lines) are matched by the same identity
+ * as merge, counts are normalized by each profile's total samples, and
+ * entries come back sorted by the size of the change in self time.
+ */
+
+typedef struct {
+    size_t counts[2][2];	/* [profile][self, total] */
+    double delta;
+    double total_delta;
+} diff_count_t;
+
+typedef struct {
+    VALUE index;		/* identity => position */
+    VALUE entries;		/* result hashes, by position */
+    diff_count_t *counts;
+    long capa;
+} diff_table_t;
+
+typedef struct {
+    diff_table_t frames;
+    diff_table_t lines;
+    int side;
+    VALUE frame;		/* identity of the frame whose lines are added */
+    VALUE details;
+} diff_t;
+
+static void
+diff_add(diff_table_t *t, VALUE identity, VALUE name, VALUE file, VALUE line,
+	 int side, VALUE self_samples, VALUE total_samples)
+{
+    VALUE pos = rb_hash_lookup2(t->index, identity, Qundef);
+    diff_count_t *c;
+    long i;
+
+    if (pos == Qundef) {
+	VALUE entry = rb_hash_new();
+
+	rb_hash_aset(entry, sym_name, name);
+	rb_hash_aset(entry, sym_file, file);
+	if (!NIL_P(line))
+	    rb_hash_aset(entry, sym_line, line);
+	i = RARRAY_LEN(t->entries);
+	rb_ary_push(t->entries, entry);
+	rb_hash_aset(t->index, identity, LONG2FIX(i));
+	if (i >= t->capa) {
+	    t->capa = t->capa ? t->capa * 2 : 64;
+	    REALLOC_N(t->counts, diff_count_t, t->capa);
+	}
+	MEMZERO(&t->counts[i], diff_count_t, 1);
+    } else {
+	i = FIX2LONG(pos);
+    }
+
+    c = &t->counts[i];
+    if (!NIL_P(self_samples))
+	c->counts[side][0] += NUM2SIZET(self_samples);
+    if (!NIL_P(total_samples))
+	c->counts[side][1] += NUM2SIZET(total_samples);
+}
+
+static int
+diff_line_i(VALUE line, VALUE weights, VALUE arg)
+{
+    diff_t *d = (diff_t *)arg;
+    VALUE identity = rb_ary_dup(d->frame);
+
+    if (!RB_TYPE_P(weights, T_ARRAY) || RARRAY_LEN(weights) < 2)
+	return ST_CONTINUE;
+    rb_ary_push(identity, line);
+    diff_add(&d->lines, rb_obj_freeze(identity),
+	     rb_hash_aref(d->details, sym_name), rb_hash_aref(d->details, sym_file), line,
+	     d->side, RARRAY_AREF(weights, 1), RARRAY_AREF(weights, 0));
+    return ST_CONTINUE;
+}
+
+static int
+diff_frame_i(VALUE id, VALUE frame, VALUE arg)
+{
+    diff_t *d = (diff_t *)arg;
+    VALUE identity = merge_frame_identity(frame), lines;
+
+    diff_add(&d->frames, identity,
+	     rb_hash_aref(frame, sym_name), rb_hash_aref(frame, sym_file), rb_hash_aref(frame, sym_line),
+	     d->side, rb_hash_aref(frame, sym_samples), rb_hash_aref(frame, sym_total_samples));
+
+    lines = rb_hash_aref(frame, sym_lines);
+    if (RB_TYPE_P(lines, T_HASH)) {
+	d->frame = identity;
+	d->details = frame;
+	rb_hash_foreach(lines, diff_line_i, arg);
+    }
+    return ST_CONTINUE;
+}
+
+static diff_count_t *diff_sort_counts;
+
+static int
+diff_cmp(const void *a, const void *b)
+{
+    const diff_count_t *x = &diff_sort_counts[*(const long *)a];
+    const diff_count_t *y = &diff_sort_counts[*(const long *)b];
+    double dx = fabs(x->delta), dy = fabs(y->delta);
+
+    if (dx == dy) {
+	dx = fabs(x->total_delta);
+	dy = fabs(y->total_delta);
+    }
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
+
+static VALUE
+diff_finish(diff_table_t *t, size_t totals[2])
+{
+    long i, len = RARRAY_LEN(t->entries);
+    long *order = ALLOC_N(long, len ? len : 1);
+    VALUE result = rb_ary_new_capa(len);
+
+    for (i = 0; i < len; i++) {
+	diff_count_t *c = &t->counts[i];
+	double share[2][2];
+	int side, k;
+
+	for (side = 0; side < 2; side++)
+	    for (k = 0; k < 2; k++)
+		share[side][k] = totals[side] ? (double)c->counts[side][k] / (double)totals[side] : 0.0;
+	c->delta = share[1][0] - share[0][0];
+	c->total_delta = share[1][1] - share[0][1];
+	order[i] = i;
+    }
+
+    diff_sort_counts = t->counts;
+    qsort(order, len, sizeof(long), diff_cmp);
+
+    for (i = 0; i < len; i++) {
+	diff_count_t *c = &t->counts[order[i]];
+	VALUE entry = RARRAY_AREF(t->entries, order[i]);
+
+	rb_hash_aset(entry, sym_samples,
+		     rb_assoc_new(SIZET2NUM(c->counts[0][0]), SIZET2NUM(c->counts[1][0])));
+	rb_hash_aset(entry, sym_total_samples,
+		     rb_assoc_new(SIZET2NUM(c->counts[0][1]), SIZET2NUM(c->counts[1][1])));
+	rb_hash_aset(entry, sym_delta, DBL2NUM(c->delta));
+	rb_hash_aset(entry, sym_total_delta, DBL2NUM(c->total_delta));
+	rb_ary_push(result, entry);
+    }
+    xfree(order);
+    return result;
+}
+
+static VALUE
+stackprofx_diff_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    diff_t *d = (diff_t *)args[2];
+    VALUE result = rb_hash_new();
+    size_t totals[2];
+
+    for (d->side = 0; d->side < 2; d->side++) {
+	VALUE profile = profile_load(args[d->side]), frames, samples;
+
+	Check_Type(profile, T_HASH);
+	samples = rb_hash_aref(profile, sym_samples);
+	totals[d->side] = NIL_P(samples) ? 0 : NUM2SIZET(samples);
+	frames = rb_hash_aref(profile, sym_frames);
+	if (RB_TYPE_P(frames, T_HASH))
+	    rb_hash_foreach(frames, diff_frame_i, (VALUE)d);
+    }
+
+    rb_hash_aset(result, sym_samples, rb_assoc_new(SIZET2NUM(totals[0]), SIZET2NUM(totals[1])));
+    rb_hash_aset(result, sym_frames, diff_finish(&d->frames, totals));
+    rb_hash_aset(result, sym_lines, diff_finish(&d->lines, totals));
+    return result;
+}
+
+static VALUE
+stackprofx_diff_ensure(VALUE arg)
+{
+    diff_t *d = (diff_t *)arg;
+
+    xfree(d->frames.counts);
+    xfree(d->lines.counts);
+    return Qnil;
+}
+
+static VALUE
+stackprofx_diff(VALUE self, VALUE a, VALUE b)
+{
+    diff_t d;
+    VALUE args[3];
+
+    MEMZERO(&d, diff_t, 1);
+    d.frames.index = rb_hash_new();
+    d.frames.entries = rb_ary_new();
+    d.lines.index = rb_hash_new();
+    d.lines.entries = rb_ary_new();
+    d.frame = d.details = Qnil;
+
+    args[0] = a;
+    args[1] = b;
+    args[2] = (VALUE)&d;
+    return rb_ensure(stackprofx_diff_body, (VALUE)args, stackprofx_diff_ensure, (VALUE)&d);
+}
+
+/*
+ * Fleet-wide aggregate of a shared: true profile, readable from any process
+ * at any time. Frames are keyed by their stable hash.
+ */
+
+static VALUE
+shared_frame_details(VALUE frames, uint64_t hash)
+{
+    shared_table_t *shared = _stackprofx.shared;
+    VALUE id = ULL2NUM(hash), details = rb_hash_aref(frames, id);
+    size_t i, idx = (size_t)hash & (SHARED_SYMBOL_SLOTS - 1);
+
+    if (!NIL_P(details))
+	return details;
+
+    details = rb_hash_new();
+    rb_hash_aset(details, sym_total_samples, INT2FIX(0));
+    rb_hash_aset(details, sym_samples, INT2FIX(0));
+    rb_hash_aset(frames, id, details);
+
+    for (i = 0; i < SHARED_SYMBOL_SLOTS; i++, idx = (idx + 1) & (SHARED_SYMBOL_SLOTS - 1)) {
+	shared_slot_t *slot = &shared->symbols[idx];
+	const char *name, *file, *line, *end;
+	long lineno = 0;
+
+	if (slot->key == 0)
+	    break;
+	if (slot->key != hash)
+	    continue;
+	if (!slot->ready || !slot->len)
+	    break;
+	if (slot->offset + slot->len > SHARED_STRING_BYTES)
+	    continue;
+
+	/* "name\0file\0line", the line unterminated; skip it if malformed */
+	name = shared->strings + slot->offset;
+	end = name + slot->len;
+	if (!(file = memchr(name, '\0', end - name)))
+	    continue;
+	file++;
+	if (!(line = memchr(file, '\0', end - file)))
+	    continue;
+	line++;
+	rb_hash_aset(details, sym_name, rb_str_new(name, file - name - 1));
+	rb_hash_aset(details, sym_file, rb_str_new(file, line - file - 1));
+	for (; line < end && *line >= '0' && *line <= '9'; line++)
+	    lineno = lineno * 10 + (*line - '0');
+	if (lineno > 0)
+	    rb_hash_aset(details, sym_line, LONG2NUM(lineno));
+	break;
+    }
+    return details;
+}
+
+static void
+hash_increment(VALUE hash, VALUE key, uint64_t count)
+{
+    VALUE current = rb_hash_aref(hash, key);
+    rb_hash_aset(hash, key, NIL_P(current) ? ULL2NUM(count) : rb_funcall(current, '+', 1, ULL2NUM(count)));
+}
+
+static VALUE
+stackprofx_shared_results(VALUE self)
+{
+    shared_table_t *shared = _stackprofx.shared;
+    VALUE results, frames;
+    size_t n;
+    uint32_t i;
+
+    if (!shared)
+	return Qnil;
+    stackprofx_shared_flush();
+
+    results = rb_hash_new();
+    rb_hash_aset(results, sym_version, DBL2NUM(1.1));
+    rb_hash_aset(results, sym_mode, _stackprofx.mode);
+    rb_hash_aset(results, sym_interval, _stackprofx.interval);
+    rb_hash_aset(results, sym_samples, ULL2NUM(shared->samples));
+    rb_hash_aset(results, sym_shared_dropped, ULL2NUM(shared->dropped));
+
+    frames = rb_hash_new();
+    rb_hash_aset(results, sym_frames, frames);
+
+    for (n = 0; n < SHARED_STACK_SLOTS; n++) {
+	shared_slot_t *slot = &shared->stacks[n];
+	uint64_t count, *stack;
+	VALUE prev = Qnil;
+
+	if (!slot->ready || !slot->len)
+	    continue;
+	count = slot->count;
+	stack = &shared->stack_words[slot->offset];
+
+	/* stacks are stored leaf first, like frames_buffer */
+	for (i = 0; i < slot->len; i++) {
+	    VALUE details = shared_frame_details(frames, stack[i]);
+
+	    hash_increment(details, sym_total_samples, count);
+	    if (i == 0) {
+		hash_increment(details, sym_samples, count);
+	    } else {
+		VALUE edges = rb_hash_aref(details, sym_edges);
+		if (NIL_P(edges)) {
+		    edges = rb_hash_new();
+		    rb_hash_aset(details, sym_edges, edges);
+		}
+		hash_increment(edges, prev, count);
+	    }
+	    prev = ULL2NUM(stack[i]);
+	}
+    }
+
+    return results;
+}
+
+static VALUE
+stackprofx_run(int argc, VALUE *argv, VALUE self)
+{
+    rb_need_block();
+    stackprofx_start(argc, argv, self);
+    rb_ensure(rb_yield, Qundef, stackprofx_stop, self);
+    return stackprofx_results(0, 0, self);
+}
+
+static VALUE
+stackprofx_running_p(VALUE self)
+{
+    return _stackprofx.running ? Qtrue : Qfalse;
+}
+
+/*
+ * The large allocations are kept off the sampling path. Frame records and
+ * edge/line tables come from pools reserved at start, raw chunks are mapped
+ * one ahead, and tables close to st's rehash point are queued to be regrown
+ * later. A postponed housekeeping job does the refilling. What is left is
+ * one small st entry per new key, plus whatever housekeeping could not get
+ * to in time; all of it is counted in hot_allocations.
+ */
+static void
+stackprofx_housekeeping(void *data)
+{
+    _stackprofx.housekeeping = 0;
+    if (_stackprofx.running)
+	stackprofx_reserve();
+    stackprofx_shared_flush();
+}
+
+static void
+stackprofx_housekeeping_request(void)
+{
+    if (_stackprofx.housekeeping)
+	return;
+    _stackprofx.housekeeping = 1;
+    rb_postponed_job_register_one(0, stackprofx_housekeeping, 0);
+}
+
+static int
+table_copy_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    st_add_direct((st_table *)arg, key, val);
+    return ST_CONTINUE;
+}
+
+static void
+table_grow(st_table **slot)
+{
+    st_table *table = *slot, *grown;
+
+    if (!table)
+	return;
+    grown = st_init_numtable_with_size(table->num_bins * 2);
+    st_foreach(table, table_copy_i, (st_data_t)grown);
+    _stackprofx.memory += st_memsize(grown) - st_memsize(table);
+    st_free_table(table);
+    *slot = grown;
+}
+
+static void
+stackprofx_reserve(void)
+{
+    int i;
+
+    for (i = 0; i < _stackprofx.grow_queue_len; i++)
+	table_grow(_stackprofx.grow_queue[i]);
+    _stackprofx.grow_queue_len = 0;
+
+    /* reserves count against max_memory when made, not when handed out */
+    while (_stackprofx.frame_pool_len < FRAME_POOL_SIZE) {
+	_stackprofx.frame_pool[_stackprofx.frame_pool_len++] = ALLOC(frame_data_t);
+	_stackprofx.memory += sizeof(frame_data_t);
+    }
+    while (_stackprofx.table_pool_len < TABLE_POOL_SIZE) {
+	st_table *table = st_init_numtable_with_size(TABLE_INIT_BINS);
+	_stackprofx.table_pool[_stackprofx.table_pool_len++] = table;
+	_stackprofx.memory += st_memsize(table);
+    }
+
+    if (_stackprofx.raw && !_stackprofx.raw_samples.spare) {
+	raw_chunk_t *chunk = raw_chunk_map(RAW_CHUNK_SIZE / 2);
+	if (chunk) {
+	    _stackprofx.raw_samples.spare = chunk;
+	    _stackprofx.raw_samples.mapped += chunk->mapped;
+	}
+    }
+    if (_stackprofx.timestamps && !_stackprofx.raw_timestamps.spare) {
+	raw_chunk_t *chunk = raw_chunk_map(RAW_CHUNK_SIZE / 2);
+	if (chunk) {
+	    _stackprofx.raw_timestamps.spare = chunk;
+	    _stackprofx.raw_timestamps.mapped += chunk->mapped;
+	}
+    }
+}
+
+/* After an insert: count a rehash that happened, or queue one that is near. */
+static inline void
+table_check(st_table **slot, st_index_t bins)
+{
+    st_table *table = *slot;
+    int i;
+
+    if (table->num_bins != bins) {
+	_stackprofx.hot_allocations++;
+	return;
+    }
+    if (table->entries_packed || table->num_entries < table->num_bins * (ST_MAX_DENSITY - 1))
+	return;
+
+    for (i = 0; i < _stackprofx.grow_queue_len; i++)
+	if (_stackprofx.grow_queue[i] == slot)
+	    return;
+    if (i < GROW_QUEUE_SIZE)
+	_stackprofx.grow_queue[_stackprofx.grow_queue_len++] = slot;
+    stackprofx_housekeeping_request();
+}
+
+static frame_data_t *
+frame_data_insert(VALUE frame)
+{
+    frame_data_t *frame_data;
+    size_t before = _stackprofx.max_memory ? st_memsize(_stackprofx.frames) : 0;
+    st_index_t bins = _stackprofx.frames->num_bins;
+
+    if (_stackprofx.frame_pool_len) {
+	frame_data = _stackprofx.frame_pool[--_stackprofx.frame_pool_len];
+    } else {
+	frame_data = ALLOC(frame_data_t);
+	_stackprofx.hot_allocations++;
+	_stackprofx.memory += sizeof(frame_data_t);
+    }
+    if (_stackprofx.frame_pool_len < FRAME_POOL_SIZE / 2)
+	stackprofx_housekeeping_request();
+
+    MEMZERO(frame_data, frame_data_t, 1);
+    frame_data->id = ++_stackprofx.frame_ids;
+    st_insert(_stackprofx.frames, (st_data_t)frame, (st_data_t)frame_data);
+    count_st_entry(_stackprofx.frames);
+    if (_stackprofx.max_memory)
+	_stackprofx.memory += st_memsize(_stackprofx.frames) - before;
+    table_check(&_stackprofx.frames, bins);
+    return frame_data;
+}
+
+/* Once frames are being folded, unseen frames are recorded as (other). */
+static inline frame_data_t *
+sample_for(VALUE *frame)
+{
+    st_data_t key = (st_data_t)*frame, val = 0;
+
+    if (st_lookup(_stackprofx.frames, key, &val))
+	return (frame_data_t *)val;
+
+    if (_stackprofx.fold_frames) {
+	*frame = FRAME_OTHER;
+	if (st_lookup(_stackprofx.frames, (st_data_t)FRAME_OTHER, &val))
+	    return (frame_data_t *)val;
+    }
+    return frame_data_insert(*frame);
+}
+
+static st_table *
+numtable_new(void)
+{
+    st_table *table;
+
+    if (_stackprofx.table_pool_len) {
+	table = _stackprofx.table_pool[--_stackprofx.table_pool_len];
+    } else {
+	table = st_init_numtable_with_size(TABLE_INIT_BINS);
+	_stackprofx.hot_allocations++;
+	_stackprofx.memory += st_memsize(table);
+    }
+    if (_stackprofx.table_pool_len < TABLE_POOL_SIZE / 2)
+	stackprofx_housekeeping_request();
+    return table;
+}
+
+static int
+numtable_increment_callback(st_data_t *key, st_data_t *value, st_data_t arg, int existing)
+{
+    size_t *weight = (size_t *)value;
+    size_t increment = (size_t)arg;
+
+    if (existing)
+	(*weight) += increment;
+    else
+	*weight = increment;
+
+    return ST_CONTINUE;
+}
+
+void
+st_numtable_increment(st_table *table, st_data_t key, size_t increment)
+{
+    size_t before = _stackprofx.max_memory ? st_memsize(table) : 0;
+
+    st_update(table, key, numtable_increment_callback, (st_data_t)increment);
+    if (_stackprofx.max_memory)
+	_stackprofx.memory += st_memsize(table) - before;
+}
+
+/* Count key in the table at *slot, taking the table from the pool if new. */
+static inline void
+table_increment(st_table **slot, st_data_t key, size_t increment)
+{
+    st_index_t bins, entries;
+
+    if (!*slot)
+	*slot = numtable_new();
+    bins = (*slot)->num_bins;
+    entries = (*slot)->num_entries;
+    st_numtable_increment(*slot, key, increment);
+    if ((*slot)->num_entries != entries)
+	count_st_entry(*slot);
+    table_check(slot, bins);
+}
+
+/*
+ * max_memory: when the profiler's own memory goes over the cap it sheds
+ * data in stages, cheapest loss first: line tables, then raw samples, then
+ * the rarer half of the frames, which are folded into a single (other)
+ * frame. The running count is approximate (table and pool sizes, no
+ * allocator overhead) and only maintained while a cap is set; after each
+ * stage it is recounted from the tables.
+ */
+
+static int
+frame_memsize_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_data_t *frame_data = (frame_data_t *)val;
+    size_t *size = (size_t *)arg;
+
+    *size += sizeof(frame_data_t);
+    if (frame_data->edges)
+	*size += st_memsize(frame_data->edges);
+    if (frame_data->lines)
+	*size += st_memsize(frame_data->lines);
+    return ST_CONTINUE;
+}
+
+static int
+gvl_waits_memsize_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    gvl_stack_t *stack;
+
+    for (stack = (gvl_stack_t *)val; stack; stack = stack->next)
+	*(size_t *)arg += offsetof(gvl_stack_t, frames) + sizeof(VALUE) * (stack->num ? stack->num : 1);
+    return ST_CONTINUE;
+}
+
+static int
+fiber_counts_memsize_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    fiber_count_t *fc = (fiber_count_t *)val;
+
+    *(size_t *)arg += sizeof(fiber_count_t) + (fc->frames ? st_memsize(fc->frames) : 0);
+    return ST_CONTINUE;
+}
+
+static size_t
+table_memsize(st_table *table, size_t entry_size)
+{
+    return table ? st_memsize(table) + table->num_entries * entry_size : 0;
+}
+
+static size_t
+stackprofx_memsize(void)
+{
+    size_t size = 0;
+    int i;
+
+    if (_stackprofx.frames) {
+	size += st_memsize(_stackprofx.frames);
+	st_foreach(_stackprofx.frames, frame_memsize_i, (st_data_t)&size);
+    }
+    size += _stackprofx.raw_samples.mapped + _stackprofx.raw_timestamps.mapped;
+    if (_stackprofx.sample_threads)
+	size += st_memsize(_stackprofx.sample_threads);
+    if (_stackprofx.fiber_counts) {
+	size += st_memsize(_stackprofx.fiber_counts);
+	st_foreach(_stackprofx.fiber_counts, fiber_counts_memsize_i, (st_data_t)&size);
+    }
+    if (_stackprofx.gvl_waits) {
+	size += st_memsize(_stackprofx.gvl_waits);
+	st_foreach(_stackprofx.gvl_waits, gvl_waits_memsize_i, (st_data_t)&size);
+    }
+    size += table_memsize(_stackprofx.thread_stats, sizeof(thread_stat_t));
+    size += table_memsize(_stackprofx.external_iseqs, 0);
+
+    /* reserves and interned frames are never shed, but still held */
+    size += _stackprofx.frame_pool_len * sizeof(frame_data_t);
+    for (i = 0; i < _stackprofx.table_pool_len; i++)
+	size += st_memsize(_stackprofx.table_pool[i]);
+    size += table_memsize(frame_symbols, sizeof(frame_symbols_t));
+    size += table_memsize(cfunc_frames, sizeof(cfunc_frame_t));
+    size += table_memsize(native_frames, sizeof(native_frame_t));
+    return size;
+}
+
+static int
+frame_drop_lines_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_data_t *frame_data = (frame_data_t *)val;
+
+    if (frame_data->lines) {
+	st_free_table(frame_data->lines);
+	frame_data->lines = NULL;
+    }
+    return ST_CONTINUE;
+}
+
+static int
+frame_totals_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    size_t **totals = (size_t **)arg;
+
+    if ((VALUE)key != FRAME_OTHER)
+	*(*totals)++ = ((frame_data_t *)val)->total_samples;
+    return ST_CONTINUE;
+}
+
+static int
+size_t_cmp(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+struct fold_arg {
+    size_t threshold;
+    frame_data_t *other;
+};
+
+static int
+edges_fold_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    st_table *edges = (st_table *)arg;
+    st_data_t target = key;
+
+    if ((VALUE)key != FRAME_OTHER && !st_lookup(_stackprofx.frames, key, 0))
+	target = (st_data_t)FRAME_OTHER;
+    st_update(edges, target, numtable_increment_callback, val);
+    return ST_CONTINUE;
+}
+
+static st_table *
+edges_fold(st_table *edges, st_table *into)
+{
+    if (!into)
+	into = st_init_numtable();
+    st_foreach(edges, edges_fold_i, (st_data_t)into);
+    return into;
+}
+
+static int
+frame_fold_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct fold_arg *fa = (struct fold_arg *)arg;
+    frame_data_t *frame_data = (frame_data_t *)val;
+
+    if ((VALUE)key == FRAME_OTHER || frame_data->total_samples > fa->threshold)
+	return ST_CONTINUE;
+
+    fa->other->total_samples += frame_data->total_samples;
+    fa->other->caller_samples += frame_data->caller_samples;
+    if (frame_data->edges) {
+	fa->other->edges = edges_fold(frame_data->edges, fa->other->edges);
+	st_free_table(frame_data->edges);
+    }
+    if (frame_data->lines)
+	st_free_table(frame_data->lines);
+    xfree(frame_data);
+    _stackprofx.folded_frames++;
+    return ST_DELETE;
+}
+
+static int
+frame_refold_edges_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_data_t *frame_data = (frame_data_t *)val;
+
+    if (frame_data->edges) {
+	st_table *edges = edges_fold(frame_data->edges, NULL);
+	st_free_table(frame_data->edges);
+	frame_data->edges = edges;
+    }
+    return ST_CONTINUE;
+}
+
+static void
+stackprofx_fold_frames(void)
+{
+    size_t n = _stackprofx.frames->num_entries, *totals, *end;
+    struct fold_arg fa;
+    st_data_t val;
+
+    totals = end = ALLOC_N(size_t, n ? n : 1);
+    st_foreach(_stackprofx.frames, frame_totals_i, (st_data_t)&end);
+    if (end == totals) {
+	xfree(totals);
+	return;
+    }
+    qsort(totals, end - totals, sizeof(size_t), size_t_cmp);
+    fa.threshold = totals[(end - totals) / 2];
+    xfree(totals);
+
+    if (st_lookup(_stackprofx.frames, (st_data_t)FRAME_OTHER, &val))
+	fa.other = (frame_data_t *)val;
+    else
+	fa.other = frame_data_insert(FRAME_OTHER);
+
+    st_foreach(_stackprofx.frames, frame_fold_i, (st_data_t)&fa);
+    /* callers of folded frames now point at (other) */
+    st_foreach(_stackprofx.frames, frame_refold_edges_i, 0);
+    _stackprofx.fold_frames = 1;
+}
+
+static void
+stackprofx_degrade(void)
+{
+    if (!_stackprofx.lines_dropped) {
+	st_foreach(_stackprofx.frames, frame_drop_lines_i, 0);
+	_stackprofx.lines_dropped = 1;
+    } else if (_stackprofx.raw && !_stackprofx.raw_dropped_all) {
+	stackprofx_raw_free();
+	_stackprofx.raw_dropped_all = 1;
+    } else {
+	size_t folded = _stackprofx.folded_frames;
+
+	stackprofx_fold_frames();
+	/* what is left is (other) and the fixed costs: nothing more to shed */
+	if (_stackprofx.folded_frames == folded)
+	    _stackprofx.shed_exhausted = 1;
+    }
+    /* queued slots may belong to frames that were just freed */
+    _stackprofx.grow_queue_len = 0;
+    stackprofx_select_recorder();
+    _stackprofx.memory = stackprofx_memsize();
+}
+
+// thanks to https://bugs.ruby-lang.org/issues/10602
+int
+rb_profile_frames_thread(int start, int limit, VALUE *buff, int *lines, rb_thread_t *th)
 {
     int i;
     rb_control_frame_t *cfp = th->cfp, *end_cfp = RUBY_VM_END_CONTROL_FRAME(th);
 
-    for (i=0; i<limit && cfp != end_cfp;) {
-	if (cfp->iseq && cfp->pc) { /* should be NORMAL_ISEQ */
-	    if (start > 0) {
-		start--;
-		continue;
+    for (i=0; i<limit && cfp != end_cfp;) {
+	if (cfp->iseq && cfp->pc) { /* should be NORMAL_ISEQ */
+	    if (start > 0) {
+		start--;
+		continue;
+	    }
+
+	    /* record frame info */
+	    buff[i] = cfp->iseq->self;
+	    if (lines) lines[i] = rb_iseq_line_no(cfp->iseq, cfp->pc - cfp->iseq->iseq_encoded);
+	    i++;
+	} else if (_stackprofx.cfunc && RUBYVM_CFUNC_FRAME_P(cfp) && cfp->me) {
+	    buff[i] = cfunc_frame_key(cfp->me);
+	    if (lines) lines[i] = 0;
+	    i++;
+	}
+	cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp);
+    }
+
+    return i;
+}
+
+static uint64_t
+monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t
+monotonic_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t
+varint_encode(unsigned char *ptr, uint64_t val)
+{
+    size_t len = 0;
+
+    while (val >= 0x80) {
+	ptr[len++] = (unsigned char)(val | 0x80);
+	val >>= 7;
+    }
+    ptr[len++] = (unsigned char)val;
+    return len;
+}
+
+/* ptr is space reserved for two varints of at most 10 bytes each */
+static void
+stackprofx_record_timestamp(VALUE thread, unsigned char *ptr)
+{
+    st_data_t index;
+    size_t len;
+
+    if (!st_lookup(_stackprofx.sample_threads, (st_data_t)thread, &index)) {
+	index = (st_data_t)_stackprofx.sample_threads->num_entries;
+	st_add_direct(_stackprofx.sample_threads, (st_data_t)thread, index);
+	count_st_entry(_stackprofx.sample_threads);
+    }
+
+    len = varint_encode(ptr, _stackprofx.sample_timestamp - _stackprofx.last_timestamp);
+    len += varint_encode(ptr + len, (uint64_t)index);
+    raw_store_commit(&_stackprofx.raw_timestamps, len);
+    _stackprofx.last_timestamp = _stackprofx.sample_timestamp;
+}
+
+static uint64_t
+fnv1a(uint64_t hash, const void *ptr, size_t len)
+{
+    const unsigned char *p = ptr;
+
+    while (len--) {
+	hash ^= *p++;
+	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+/* The slot holding key, claiming a free one if needed; NULL when full. */
+static shared_slot_t *
+shared_slot(shared_slot_t *slots, size_t nslots, uint64_t key, int *fresh)
+{
+    size_t i, idx = (size_t)key & (nslots - 1);
+
+    *fresh = 0;
+    for (i = 0; i < nslots; i++, idx = (idx + 1) & (nslots - 1)) {
+	shared_slot_t *slot = &slots[idx];
+
+	if (slot->key == key)
+	    return slot;
+	if (slot->key == 0) {
+	    if (__sync_bool_compare_and_swap(&slot->key, 0, key)) {
+		*fresh = 1;
+		return slot;
+	    }
+	    if (slot->key == key)
+		return slot;
+	}
+    }
+    return NULL;
+}
+
+static uint64_t
+shared_frame_hash(VALUE frame)
+{
+    shared_table_t *shared = _stackprofx.shared;
+    shared_slot_t *slot;
+    st_data_t hash;
+    VALUE name, file, symbol;
+    int fresh;
+
+    if (st_lookup(_stackprofx.shared_hashes, (st_data_t)frame, &hash))
+	return (uint64_t)hash;
+
+    name = frame_full_label(frame);
+    file = frame_path(frame);
+    symbol = rb_str_new(0, 0);
+    if (!NIL_P(name)) rb_str_append(symbol, name);
+    rb_str_cat(symbol, "", 1);
+    if (!NIL_P(file)) rb_str_append(symbol, file);
+    rb_str_cat(symbol, "", 1);
+    rb_str_append(symbol, rb_obj_as_string(frame_first_lineno(frame)));
+
+    hash = (st_data_t)fnv1a(FNV_OFFSET, RSTRING_PTR(symbol), RSTRING_LEN(symbol));
+    if (!hash) hash = 1;
+
+    slot = shared_slot(shared->symbols, SHARED_SYMBOL_SLOTS, (uint64_t)hash, &fresh);
+    if (slot && fresh) {
+	uint64_t off = __sync_fetch_and_add(&shared->string_used, (uint64_t)RSTRING_LEN(symbol));
+	if (off + RSTRING_LEN(symbol) <= SHARED_STRING_BYTES) {
+	    memcpy(shared->strings + off, RSTRING_PTR(symbol), RSTRING_LEN(symbol));
+	    slot->offset = off;
+	    slot->len = (uint32_t)RSTRING_LEN(symbol);
+	}
+	__sync_synchronize();
+	slot->ready = 1;
+    }
+
+    st_insert(_stackprofx.shared_hashes, (st_data_t)frame, hash);
+    return (uint64_t)hash;
+}
+
+/* Count the stack of frame hashes in shared_buffer. */
+static void
+shared_record_hashes(int num)
+{
+    shared_table_t *shared = _stackprofx.shared;
+    shared_slot_t *slot;
+    uint64_t hash;
+    int fresh;
+
+    hash = fnv1a(FNV_OFFSET, _stackprofx.shared_buffer, sizeof(uint64_t) * num);
+    if (!hash) hash = 1;
+
+    slot = shared_slot(shared->stacks, SHARED_STACK_SLOTS, hash, &fresh);
+    if (!slot) {
+	__sync_fetch_and_add(&shared->dropped, 1);
+	return;
+    }
+    if (fresh) {
+	uint64_t off = __sync_fetch_and_add(&shared->stack_used, (uint64_t)num);
+	if (off + num <= SHARED_STACK_WORDS) {
+	    memcpy(&shared->stack_words[off], _stackprofx.shared_buffer, sizeof(uint64_t) * num);
+	    slot->offset = off;
+	    slot->len = (uint32_t)num;
+	}
+	__sync_synchronize();
+	slot->ready = 1;
+    }
+    __sync_fetch_and_add(&slot->count, 1);
+}
+
+static void
+stackprofx_record_shared(int num)
+{
+    st_data_t hash;
+    int i;
+
+    for (i = 0; i < num; i++) {
+	if (!st_lookup(_stackprofx.shared_hashes, (st_data_t)_stackprofx.frames_buffer[i], &hash))
+	    break;
+	_stackprofx.shared_buffer[i] = (uint64_t)hash;
+    }
+    if (i == num) {
+	shared_record_hashes(num);
+	return;
+    }
+
+    if (_stackprofx.shared_pending_len + 1 + num > SHARED_PENDING_WORDS) {
+	__sync_fetch_and_add(&_stackprofx.shared->dropped, 1);
+	return;
+    }
+    _stackprofx.shared_pending[_stackprofx.shared_pending_len] = (VALUE)num;
+    MEMCPY(&_stackprofx.shared_pending[_stackprofx.shared_pending_len + 1], _stackprofx.frames_buffer, VALUE, num);
+    _stackprofx.shared_pending_len += 1 + num;
+    stackprofx_housekeeping_request();
+}
+
+/* Hash the parked stacks' new frames, publishing their symbols, and count them. */
+static void
+stackprofx_shared_flush(void)
+{
+    size_t o = 0;
+    int i, num;
+
+    if (!_stackprofx.shared)
+	return;
+    while (o < _stackprofx.shared_pending_len) {
+	num = (int)_stackprofx.shared_pending[o];
+	for (i = 0; i < num; i++)
+	    _stackprofx.shared_buffer[i] = shared_frame_hash(_stackprofx.shared_pending[o + 1 + i]);
+	shared_record_hashes(num);
+	o += 1 + num;
+    }
+    _stackprofx.shared_pending_len = 0;
+}
+
+static void
+stackprofx_shared_unmap(void)
+{
+    if (!_stackprofx.shared)
+	return;
+    munmap(_stackprofx.shared, sizeof(shared_table_t));
+    _stackprofx.shared = NULL;
+    _stackprofx.shared_pending_len = 0;
+    /* the hashes are stable, but a new segment needs its symbols written again */
+    st_free_table(_stackprofx.shared_hashes);
+    _stackprofx.shared_hashes = NULL;
+}
+
+static void
+stackprofx_record_raw(VALUE owner, int num, const int lines)
+{
+    VALUE *last = _stackprofx.raw_sample_last, *sample;
+    VALUE head = (VALUE)num | (lines ? RAW_LINES_FLAG : 0);
+    size_t words = num + 2 + (lines ? RAW_LINE_WORDS(num) : 0);
+    unsigned char *ts = NULL;
+    int found = 0, i, n, *sample_lines;
+
+    if (_stackprofx.timestamps && !(ts = raw_store_reserve(&_stackprofx.raw_timestamps, 20))) {
+	_stackprofx.raw_dropped++;
+	return;
+    }
+
+    if (last && last[0] == head) {
+	sample_lines = RAW_LINES(last);
+	for (i = num-1, n = 0; i >= 0; i--, n++) {
+	    VALUE frame = _stackprofx.frames_buffer[i];
+	    if (last[1 + n] != frame)
+		break;
+	    if (lines && sample_lines[n] != _stackprofx.lines_buffer[i])
+		break;
+	}
+	if (i == -1) {
+	    last[num + 1] += 1;
+	    found = 1;
+	}
+    }
+
+    if (!found) {
+	sample = raw_store_reserve(&_stackprofx.raw_samples, sizeof(VALUE) * words);
+	if (sample) {
+	    sample[0] = head;
+	    for (i = num-1, n = 1; i >= 0; i--, n++)
+		sample[n] = _stackprofx.frames_buffer[i];
+	    sample[num + 1] = (VALUE)1;
+	    if (lines) {
+		sample_lines = RAW_LINES(sample);
+		for (i = num-1, n = 0; i >= 0; i--, n++)
+		    sample_lines[n] = _stackprofx.lines_buffer[i];
 	    }
-
-	    /* record frame info */
-	    buff[i] = cfp->iseq->self;
-	    if (lines) lines[i] = rb_iseq_line_no(cfp->iseq, cfp->pc - cfp->iseq->iseq_encoded);
-	    i++;
+	    raw_store_commit(&_stackprofx.raw_samples, sizeof(VALUE) * words);
+	    _stackprofx.raw_sample_last = sample;
+	    found = 1;
+	} else {
+	    _stackprofx.raw_dropped++;
 	}
-	cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp);
     }
 
-    return i;
+    if (found && ts)
+	stackprofx_record_timestamp(owner, ts);
 }
 
-int
-stackprofx_record_sample_i(st_data_t key, st_data_t val, st_data_t arg)
+#ifndef ALWAYS_INLINE
+# ifdef __GNUC__
+#  define ALWAYS_INLINE(x) __attribute__ ((__always_inline__)) x
+# else
+#  define ALWAYS_INLINE(x) x
+# endif
+#endif
+
+/*
+ * The per-stack recorder is stamped out once per combination of shared,
+ * raw, aggregate (edges) and lines, with the flags as constants, so the
+ * frame loop carries no option checks. Lines are only kept with the
+ * aggregate, so there are three aggregate levels, not four.
+ * stackprofx_select_recorder picks the variant whenever the options change:
+ * at start, and when memory pressure drops lines or raw samples.
+ *
+ * The :threads filter is not part of it: it only picks which thread table
+ * a tick walks, once per tick rather than once per stack or frame.
+ */
+static inline ALWAYS_INLINE(void
+stackprofx_record_stack(VALUE owner, int num, const int shared, const int raw, const int aggregate, const int lines));
+
+static inline void
+stackprofx_record_stack(VALUE owner, int num, const int shared, const int raw, const int aggregate, const int lines)
 {
-    int num, i, n;
+    int i;
     VALUE prev_frame = Qnil;
 
-    rb_thread_t *th;
-    GetThreadPtr((VALUE)key, th);
-    if (th->status != THREAD_RUNNABLE) return ST_CONTINUE;
-
-    num = rb_profile_frames_thread(0, sizeof(_stackprofx.frames_buffer) / sizeof(VALUE), _stackprofx.frames_buffer, _stackprofx.lines_buffer, th);
+    if (shared)
+	stackprofx_record_shared(num);
+    if (raw)
+	stackprofx_record_raw(owner, num, aggregate && lines);
 
-    if (_stackprofx.raw) {
-	int found = 0;
+    for (i = 0; i < num; i++) {
+	VALUE frame = _stackprofx.frames_buffer[i];
+	frame_data_t *frame_data = sample_for(&frame);
 
-	if (!_stackprofx.raw_samples) {
-	    _stackprofx.raw_samples_capa = num * 100;
-	    _stackprofx.raw_samples = malloc(sizeof(VALUE) * _stackprofx.raw_samples_capa);
-	}
+	frame_data->total_samples++;
 
-	if (_stackprofx.raw_samples_capa <= _stackprofx.raw_samples_len + num) {
-	    _stackprofx.raw_samples_capa *= 2;
-	    _stackprofx.raw_samples = realloc(_stackprofx.raw_samples, sizeof(VALUE) * _stackprofx.raw_samples_capa);
+	if (i == 0) {
+	    frame_data->caller_samples++;
+	} else if (aggregate) {
+	    table_increment(&frame_data->edges, (st_data_t)prev_frame, 1);
 	}
 
-	if (_stackprofx.raw_samples_len > 0 && _stackprofx.raw_samples[_stackprofx.raw_sample_index] == (VALUE)num) {
-	    for (i = num-1, n = 0; i >= 0; i--, n++) {
-		VALUE frame = _stackprofx.frames_buffer[i];
-		if (_stackprofx.raw_samples[_stackprofx.raw_sample_index + 1 + n] != frame)
-		    break;
-	    }
-	    if (i == -1) {
-		_stackprofx.raw_samples[_stackprofx.raw_samples_len-1] += 1;
-		found = 1;
+	if (aggregate && lines) {
+	    int line = _stackprofx.lines_buffer[i];
+	    if (line > 0) {
+		size_t half = (size_t)1<<(8*SIZEOF_SIZE_T/2);
+		size_t increment = i == 0 ? half + 1 : half;
+		table_increment(&frame_data->lines, (st_data_t)line, increment);
 	    }
 	}
 
-	if (!found) {
-	    _stackprofx.raw_sample_index = _stackprofx.raw_samples_len;
-	    _stackprofx.raw_samples[_stackprofx.raw_samples_len++] = (VALUE)num;
-	    for (i = num-1; i >= 0; i--) {
-		VALUE frame = _stackprofx.frames_buffer[i];
-		_stackprofx.raw_samples[_stackprofx.raw_samples_len++] = frame;
-	    }
-	    _stackprofx.raw_samples[_stackprofx.raw_samples_len++] = (VALUE)1;
-	}
+	prev_frame = frame;
+    }
+}
+
+#define RECORD_VARIANT(shared, raw, aggregate, lines) \
+static void \
+stackprofx_record_stack_##shared##raw##aggregate##lines(VALUE owner, int num) \
+{ \
+    stackprofx_record_stack(owner, num, shared, raw, aggregate, lines); \
+}
+
+RECORD_VARIANT(0, 0, 0, 0)
+RECORD_VARIANT(0, 0, 1, 0)
+RECORD_VARIANT(0, 0, 1, 1)
+RECORD_VARIANT(0, 1, 0, 0)
+RECORD_VARIANT(0, 1, 1, 0)
+RECORD_VARIANT(0, 1, 1, 1)
+RECORD_VARIANT(1, 0, 0, 0)
+RECORD_VARIANT(1, 0, 1, 0)
+RECORD_VARIANT(1, 0, 1, 1)
+RECORD_VARIANT(1, 1, 0, 0)
+RECORD_VARIANT(1, 1, 1, 0)
+RECORD_VARIANT(1, 1, 1, 1)
+
+#undef RECORD_VARIANT
+
+/* indexed by shared, raw, then aggregate + lines: none, edges, edges and lines */
+static void (*const record_variants[2][2][3])(VALUE, int) = {
+    {
+	{ stackprofx_record_stack_0000, stackprofx_record_stack_0010, stackprofx_record_stack_0011 },
+	{ stackprofx_record_stack_0100, stackprofx_record_stack_0110, stackprofx_record_stack_0111 },
+    },
+    {
+	{ stackprofx_record_stack_1000, stackprofx_record_stack_1010, stackprofx_record_stack_1011 },
+	{ stackprofx_record_stack_1100, stackprofx_record_stack_1110, stackprofx_record_stack_1111 },
+    },
+};
+
+static void
+stackprofx_select_recorder(void)
+{
+    int aggregate = _stackprofx.aggregate;
+    int lines = aggregate && !_stackprofx.lines_dropped && !_stackprofx.method_granularity;
+
+    _stackprofx.record_stack = record_variants[!!_stackprofx.shared][!!_stackprofx.raw][aggregate + lines];
+    /* line numbers are only looked up when something will use them */
+    _stackprofx.lines = lines ? _stackprofx.lines_buffer : NULL;
+}
+
+/*
+ * Count the stack in frames_buffer against its fiber. Suspended stacks are
+ * only aggregated here, never into the profile's frames, so frame totals
+ * keep adding up to the samples taken of running code.
+ */
+static void
+stackprofx_count_fiber(VALUE fiber, VALUE thread, int num, int suspended)
+{
+    size_t half = (size_t)1<<(8*SIZEOF_SIZE_T/2);
+    fiber_count_t *fc;
+    st_data_t val;
+    int i;
+
+    if (!st_lookup(_stackprofx.fiber_counts, (st_data_t)fiber, &val)) {
+	fc = ALLOC(fiber_count_t);
+	fc->thread = thread;
+	fc->samples = fc->suspended = 0;
+	fc->frames = NULL;
+	st_add_direct(_stackprofx.fiber_counts, (st_data_t)fiber, (st_data_t)fc);
+	_stackprofx.hot_allocations++;
+	count_st_entry(_stackprofx.fiber_counts);
+    } else {
+	fc = (fiber_count_t *)val;
     }
+    if (suspended)
+	fc->suspended++;
+    else
+	fc->samples++;
 
     for (i = 0; i < num; i++) {
-	int line = _stackprofx.lines_buffer[i];
 	VALUE frame = _stackprofx.frames_buffer[i];
-	frame_data_t *frame_data = sample_for(frame);
 
-	frame_data->total_samples++;
+	/* interned so the frame has an id, without counting it a sample */
+	sample_for(&frame);
+	table_increment(&fc->frames, (st_data_t)frame, i == 0 ? half + 1 : half);
+    }
+}
 
-	if (i == 0) {
-	    frame_data->caller_samples++;
-	} else if (_stackprofx.aggregate) {
-	    if (!frame_data->edges)
-		frame_data->edges = st_init_numtable();
-	    st_numtable_increment(frame_data->edges, (st_data_t)prev_frame, 1);
+/*
+ * Fibers other than the running one keep their frames in the thread copy
+ * saved when they were switched out; cont.c links all of a thread's fibers
+ * into a ring through the root fiber.
+ */
+static void
+stackprofx_record_suspended_fibers(VALUE thread, rb_thread_t *th)
+{
+    rb_fiber_t *root, *fib;
+    int num;
+
+    GetFiberPtr(th->root_fiber, root);
+    fib = root;
+    do {
+	if (fib->cont.self != th->fiber && fib->status == RUNNING) {
+	    num = rb_profile_frames_thread(0, BUF_SIZE, _stackprofx.frames_buffer, NULL, &fib->cont.saved_thread);
+	    stackprofx_count_fiber(fib->cont.self, thread, num, 1);
 	}
+	fib = fib->next_fiber;
+    } while (fib && fib != root);
+}
+
+/*
+ * :gvl mode. The tick runs on the thread holding the GVL; other runnable
+ * threads are parked waiting for it, threads inside a blocking region
+ * (I/O, or C code that released the GVL) are blocked, and the rest are
+ * sleeping on a timer, queue, mutex or join. A thread returning from a
+ * blocking region waits for the GVL before its status is restored, so it
+ * still counts as blocked; gvl_waiters sums the VM's own count of waiters
+ * per tick to show the difference.
+ */
+static void
+stackprofx_record_gvl_wait(int num)
+{
+    gvl_stack_t *stack, *head = NULL;
+    st_data_t key, val;
+    uint64_t hash;
+    int i, n;
 
-	if (_stackprofx.aggregate && line > 0) {
-	    if (!frame_data->lines)
-		frame_data->lines = st_init_numtable();
-	    size_t half = (size_t)1<<(8*SIZEOF_SIZE_T/2);
-	    size_t increment = i == 0 ? half + 1 : half;
-	    st_numtable_increment(frame_data->lines, (st_data_t)line, increment);
+    /* intern the frames so they resolve to ids, without counting samples */
+    for (i = 0; i < num; i++)
+	sample_for(&_stackprofx.frames_buffer[i]);
+
+    hash = fnv1a(FNV_OFFSET, _stackprofx.frames_buffer, sizeof(VALUE) * num);
+    key = (st_data_t)hash;
+    if (st_lookup(_stackprofx.gvl_waits, key, &val))
+	head = (gvl_stack_t *)val;
+
+    for (stack = head; stack; stack = stack->next) {
+	if (stack->num != num)
+	    continue;
+	for (i = num-1, n = 0; i >= 0; i--, n++)
+	    if (stack->frames[n] != _stackprofx.frames_buffer[i])
+		break;
+	if (i == -1) {
+	    stack->samples++;
+	    return;
 	}
+    }
 
-	prev_frame = frame;
+    stack = (gvl_stack_t *)xmalloc(offsetof(gvl_stack_t, frames) + sizeof(VALUE) * (num ? num : 1));
+    _stackprofx.hot_allocations++;
+    if (!head)
+	count_st_entry(_stackprofx.gvl_waits);
+    stack->next = head;
+    stack->samples = 1;
+    stack->num = num;
+    for (i = num-1, n = 0; i >= 0; i--, n++)
+	stack->frames[n] = _stackprofx.frames_buffer[i];
+    st_insert(_stackprofx.gvl_waits, key, (st_data_t)stack);
+}
+
+static void
+stackprofx_record_gvl(VALUE thread, rb_thread_t *th)
+{
+    int num;
+
+    if (th == GET_THREAD()) {
+	_stackprofx.gvl_states[GVL_HOLDING]++;
+	num = rb_profile_frames_thread(0, BUF_SIZE, _stackprofx.frames_buffer, _stackprofx.lines, th);
+	_stackprofx.record_stack(thread, num);
+    } else if (th->status == THREAD_RUNNABLE) {
+	_stackprofx.gvl_states[GVL_WAITING]++;
+	num = rb_profile_frames_thread(0, BUF_SIZE, _stackprofx.frames_buffer, NULL, th);
+	stackprofx_record_gvl_wait(num);
+    } else if (th->status == THREAD_STOPPED && th->blocking_region_buffer) {
+	_stackprofx.gvl_states[GVL_BLOCKED]++;
+    } else if (th->status != THREAD_KILLED) {
+	_stackprofx.gvl_states[GVL_SLEEPING]++;
+    }
+}
+
+int
+stackprofx_record_sample_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE thread = (VALUE)key, owner = thread;
+    int num, native = 0;
+
+    rb_thread_t *th;
+    GetThreadPtr(thread, th);
+
+    if (_stackprofx.thread_stats) {
+	st_index_t known = _stackprofx.thread_stats->num_entries;
+
+	thread_stat_for(thread, th)->states[th->status]++;
+	if (_stackprofx.thread_stats->num_entries != known) {
+	    _stackprofx.hot_allocations++;
+	    count_st_entry(_stackprofx.thread_stats);
+	}
+    }
+    if (_stackprofx.gvl_waits) {
+	stackprofx_record_gvl(thread, th);
+	return ST_CONTINUE;
+    }
+    if (_stackprofx.fibers) {
+	if (th->root_fiber && _stackprofx.mode == sym_wall)
+	    stackprofx_record_suspended_fibers(thread, th);
+	if (th->fiber)
+	    owner = th->fiber;
+    }
+    if (th->status != THREAD_RUNNABLE) return ST_CONTINUE;
+
+    /* native frames sit below the innermost ruby frame */
+    if (_stackprofx.native_len && th == _stackprofx.native_thread) {
+	for (native = 0; native < _stackprofx.native_len; native++) {
+	    _stackprofx.frames_buffer[native] = native_frame_key(_stackprofx.native_pcs[native]);
+	    _stackprofx.lines_buffer[native] = 0;
+	}
     }
 
+    num = native + rb_profile_frames_thread(0, BUF_SIZE - native, _stackprofx.frames_buffer + native,
+					    _stackprofx.lines ? _stackprofx.lines + native : NULL, th);
+    _stackprofx.record_stack(owner, num);
+    if (_stackprofx.fibers)
+	stackprofx_count_fiber(owner, thread, num, 0);
+
     return ST_CONTINUE;
 }
 
+static void
+stackprofx_fork_end(VALUE unused)
+{
+    VALUE out = _stackprofx.out;
+
+    stackprofx_stop(rb_mStackProfx);
+    if (!RB_TYPE_P(out, T_STRING))
+	return;
+    /* never clobber the parent's file */
+    if (NIL_P(rb_funcall(out, rb_intern("index"), 1, rb_str_new_cstr("%{pid}"))))
+	out = rb_str_plus(out, rb_str_new_cstr(".%{pid}"));
+    stackprofx_results(1, &out, rb_mStackProfx);
+}
+
+/*
+ * First sample in a child forked with fork: :continue. The atfork handler
+ * only forgot the parent's state; allocating and registering the exit hook
+ * happen here, outside of fork.
+ */
+static void
+stackprofx_after_fork(void)
+{
+    _stackprofx.fork_pending = 0;
+    _stackprofx.frames = st_init_numtable_with_size(FRAMES_INIT_BINS);
+    _stackprofx.frame_ids = 0;
+    if (_stackprofx.timestamps)
+	_stackprofx.sample_threads = st_init_numtable();
+    if (_stackprofx.fibers)
+	_stackprofx.fiber_counts = st_init_numtable();
+    if (_stackprofx.mode == sym_gvl)
+	_stackprofx.gvl_waits = st_init_numtable();
+    _stackprofx.thread_stats = st_init_numtable();
+    st_foreach(_stackprofx.threads ?: GET_THREAD()->vm->living_threads, thread_stat_start_i, 0);
+    _stackprofx.memory = stackprofx_memsize();
+
+    if (!_stackprofx.fork_end_registered) {
+	rb_set_end_proc(stackprofx_fork_end, Qnil);
+	_stackprofx.fork_end_registered = 1;
+    }
+}
+
 void
 stackprofx_record_sample()
 {
+    uint64_t started, spent;
+
+    if (_stackprofx.fork_pending)
+	stackprofx_after_fork();
+
+    started = monotonic_nsec();
     _stackprofx.overall_samples++;
+    if (_stackprofx.shared)
+	__sync_fetch_and_add(&_stackprofx.shared->samples, 1);
+    if (_stackprofx.timestamps)
+	_stackprofx.sample_timestamp = monotonic_usec();
     st_table *tbl = _stackprofx.threads ?: GET_THREAD()->vm->living_threads;
+    if (_stackprofx.gvl_waits)
+	_stackprofx.gvl_waiters += GET_THREAD()->vm->gvl.waiting;
     st_foreach(tbl, stackprofx_record_sample_i, 0);
+    _stackprofx.native_len = 0;
+
+    if (_stackprofx.max_memory && !_stackprofx.shed_exhausted && _stackprofx.memory > _stackprofx.max_memory)
+	stackprofx_degrade();
+
+    /* per-tick cost, walk of every sampled thread included */
+    spent = monotonic_nsec() - started;
+    _stackprofx.sample_ticks++;
+    _stackprofx.sampling_ns += spent;
+    if (spent > _stackprofx.sampling_max_ns)
+	_stackprofx.sampling_max_ns = spent;
 }
 
 static void
@@ -508,10 +4351,354 @@ static void
 stackprofx_signal_handler(int sig, siginfo_t *sinfo, void *ucontext)
 {
     _stackprofx.overall_signals++;
-    if (rb_during_gc())
+    if (rb_during_gc()) {
 	_stackprofx.during_gc++, _stackprofx.overall_samples++;
-    else
+    } else {
+#ifdef STACKPROFX_NATIVE
+	if (_stackprofx.native)
+	    stackprofx_capture_native(ucontext);
+#endif
 	rb_postponed_job_register_one(0, stackprofx_job_handler, 0);
+    }
+}
+
+/*
+ * external: true. Ticks come from a native thread that reads each target's
+ * control frames directly, without waiting for the thread to reach a
+ * safepoint. Nothing stops the VM while it reads, so that thread touches
+ * nothing but the target's VM stack: it bounds-checks each control frame
+ * and copies its iseq and pc words, without following either. A stack whose
+ * cfp moved during the read is kept and counted as torn.
+ *
+ * Everything else happens in a postponed job holding the GVL. An iseq
+ * pointer is only followed once it is found in external_iseqs, a registry
+ * of live iseqs filled from a heap walk at start and from the targets'
+ * stacks, and emptied by a FREEOBJ hook; a stale or garbage pointer simply
+ * misses. Stacks with a frame that misses or whose pc is outside its iseq
+ * are dropped and counted as invalid.
+ */
+
+typedef int external_each_obj_callback(void *, void *, size_t, void *);
+void rb_objspace_each_objects(external_each_obj_callback *callback, void *data);
+
+static int
+external_iseq_p(VALUE obj)
+{
+    if (BUILTIN_TYPE(obj) != T_DATA || !RTYPEDDATA_P(obj))
+	return 0;
+    if (_stackprofx.iseq_type)
+	return RTYPEDDATA_TYPE(obj) == _stackprofx.iseq_type;
+    if (strcmp(RTYPEDDATA_TYPE(obj)->wrap_struct_name, "iseq") != 0)
+	return 0;
+    _stackprofx.iseq_type = RTYPEDDATA_TYPE(obj);
+    return 1;
+}
+
+static void
+external_iseq_freeobj(VALUE tpval, void *data)
+{
+    VALUE obj = rb_tracearg_object(rb_tracearg_from_tracepoint(tpval));
+    st_data_t key;
+
+    if (_stackprofx.external_iseqs && external_iseq_p(obj)) {
+	key = (st_data_t)DATA_PTR(obj);
+	st_delete(_stackprofx.external_iseqs, &key, 0);
+    }
+}
+
+/*
+ * The sampler thread holds no GVL, so it cannot ask rb_during_gc(); GC
+ * start and end of marking flip a flag it reads instead.
+ */
+static void
+external_gc_event(VALUE tpval, void *data)
+{
+    rb_event_flag_t event = rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tpval));
+
+    _stackprofx.external_in_gc = event == RUBY_INTERNAL_EVENT_GC_START;
+}
+
+static int
+external_heap_i(void *vstart, void *vend, size_t stride, void *data)
+{
+    VALUE v;
+
+    for (v = (VALUE)vstart; v != (VALUE)vend; v += stride) {
+	if (RBASIC(v)->flags && external_iseq_p(v) && DATA_PTR(v))
+	    st_insert(_stackprofx.external_iseqs, (st_data_t)DATA_PTR(v), (st_data_t)v);
+    }
+    return 0;
+}
+
+/* Holding the GVL: register the iseqs on the targets' stacks right now. */
+static void
+external_register_running(void)
+{
+    rb_control_frame_t *cfp, *end_cfp;
+    rb_thread_t *th;
+    long i;
+
+    for (i = 0; i < _stackprofx.external_ntargets; i++) {
+	th = _stackprofx.external_ths[i];
+	if (th->status == THREAD_KILLED || !th->stack)
+	    continue;
+	end_cfp = RUBY_VM_END_CONTROL_FRAME(th);
+	for (cfp = th->cfp; cfp != end_cfp; cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+	    if (cfp->iseq && cfp->pc && RUBY_VM_NORMAL_ISEQ_P(cfp->iseq))
+		st_insert(_stackprofx.external_iseqs, (st_data_t)cfp->iseq, (st_data_t)cfp->iseq->self);
+	}
+    }
+}
+
+static int
+external_target_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE thread = (VALUE)key;
+    long n = _stackprofx.external_ntargets++;
+
+    _stackprofx.external_targets[n] = thread;
+    GetThreadPtr(thread, _stackprofx.external_ths[n]);
+    return ST_CONTINUE;
+}
+
+/* Holding the GVL: the threads to read on the following ticks. */
+static void
+stackprofx_external_targets(void)
+{
+    st_table *tbl = _stackprofx.threads ?: GET_THREAD()->vm->living_threads;
+
+    pthread_mutex_lock(&_stackprofx.external_lock);
+    if (_stackprofx.external_capa < (long)tbl->num_entries) {
+	_stackprofx.external_capa = (long)tbl->num_entries * 2;
+	REALLOC_N(_stackprofx.external_targets, VALUE, _stackprofx.external_capa);
+	REALLOC_N(_stackprofx.external_ths, rb_thread_t *, _stackprofx.external_capa);
+    }
+    _stackprofx.external_ntargets = 0;
+    st_foreach(tbl, external_target_i, 0);
+    pthread_mutex_unlock(&_stackprofx.external_lock);
+}
+
+/* Copy th's control frames into the next ring slot; 1 if one was published. */
+static int
+external_capture(VALUE thread, rb_thread_t *th, int first, uint64_t usec)
+{
+    external_slot_t *slot;
+    rb_control_frame_t *cfp, *start, *end_cfp;
+    VALUE *stack = th->stack;
+    size_t size = th->stack_size;
+    int num = 0;
+
+    if (th->status != THREAD_RUNNABLE || !stack)
+	return 0;
+    if (_stackprofx.external_head - _stackprofx.external_tail >= EXTERNAL_SLOTS) {
+	_stackprofx.external_dropped++;
+	return 0;
+    }
+    slot = &_stackprofx.external_ring[_stackprofx.external_head % EXTERNAL_SLOTS];
+
+    end_cfp = (rb_control_frame_t *)(stack + size);
+    cfp = start = th->cfp;
+    for (; cfp != end_cfp && num < EXTERNAL_DEPTH; cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+	const rb_iseq_t *iseq;
+	const VALUE *pc;
+
+	if ((void *)cfp < (void *)stack || cfp > end_cfp ||
+	    ((char *)end_cfp - (char *)cfp) % sizeof(rb_control_frame_t)) {
+	    _stackprofx.external_invalid++;
+	    return 0;
+	}
+	/* words inside the VM stack; neither is followed here */
+	iseq = cfp->iseq;
+	pc = cfp->pc;
+	if (!iseq || !pc)
+	    continue;
+	slot->iseqs[num] = iseq;
+	slot->pcs[num] = pc;
+	num++;
+    }
+
+    slot->thread = thread;
+    slot->first = first;
+    slot->torn = th->cfp != start;
+    slot->num = num;
+    slot->usec = usec;
+    __sync_synchronize();
+    _stackprofx.external_head++;
+    return 1;
+}
+
+/* Holding the GVL: the iseq object behind a captured pointer, or Qfalse. */
+static VALUE
+external_iseq_lookup(const rb_iseq_t *iseq, const VALUE *pc, int *refreshed)
+{
+    st_data_t val;
+
+    if (!st_lookup(_stackprofx.external_iseqs, (st_data_t)iseq, &val)) {
+	if (*refreshed)
+	    return Qfalse;
+	external_register_running();
+	*refreshed = 1;
+	if (!st_lookup(_stackprofx.external_iseqs, (st_data_t)iseq, &val))
+	    return Qfalse;
+    }
+    /* a live iseq now, but the pc may be from whatever lived there before */
+    if (pc < iseq->iseq_encoded || pc >= iseq->iseq_encoded + iseq->iseq_size)
+	return Qfalse;
+    return (VALUE)val;
+}
+
+static void
+external_record(external_slot_t *slot)
+{
+    uint64_t started = monotonic_nsec(), spent;
+    int i, refreshed = 0;
+    VALUE frame;
+
+    if (slot->first) {
+	__sync_fetch_and_add(&_stackprofx.overall_samples, 1);
+	_stackprofx.sample_ticks++;
+    }
+    for (i = 0; i < slot->num; i++) {
+	if (!(frame = external_iseq_lookup(slot->iseqs[i], slot->pcs[i], &refreshed))) {
+	    _stackprofx.external_invalid++;
+	    return;
+	}
+	_stackprofx.frames_buffer[i] = frame;
+	if (_stackprofx.lines)
+	    _stackprofx.lines_buffer[i] = rb_iseq_line_no(slot->iseqs[i], slot->pcs[i] - slot->iseqs[i]->iseq_encoded);
+    }
+
+    _stackprofx.external_samples++;
+    if (slot->torn)
+	_stackprofx.external_torn++;
+    _stackprofx.sample_timestamp = slot->usec;
+    _stackprofx.record_stack(slot->thread, slot->num);
+
+    if (_stackprofx.max_memory && !_stackprofx.shed_exhausted && _stackprofx.memory > _stackprofx.max_memory)
+	stackprofx_degrade();
+
+    spent = monotonic_nsec() - started;
+    _stackprofx.sampling_ns += spent;
+    if (spent > _stackprofx.sampling_max_ns)
+	_stackprofx.sampling_max_ns = spent;
+}
+
+static void
+stackprofx_external_drain(void *data)
+{
+    if (_stackprofx.running && _stackprofx.fork_pending)
+	stackprofx_after_fork();
+    if (_stackprofx.external_restart) {
+	_stackprofx.external_restart = 0;
+	if (_stackprofx.running)
+	    stackprofx_external_spawn();
+    }
+    while (_stackprofx.external_tail != _stackprofx.external_head) {
+	external_slot_t *slot = &_stackprofx.external_ring[_stackprofx.external_tail % EXTERNAL_SLOTS];
+
+	__sync_synchronize();
+	if (_stackprofx.running && _stackprofx.frames)
+	    external_record(slot);
+	_stackprofx.external_tail++;
+    }
+    if (_stackprofx.running)
+	stackprofx_external_targets();
+}
+
+static void *
+stackprofx_external_main(void *arg)
+{
+    struct timespec ts;
+    long i;
+    int first;
+
+    ts.tv_sec = _stackprofx.external_usec / 1000000;
+    ts.tv_nsec = (_stackprofx.external_usec % 1000000) * 1000;
+
+    while (!_stackprofx.external_stop) {
+	nanosleep(&ts, NULL);
+	if (_stackprofx.external_stop)
+	    break;
+
+	__sync_fetch_and_add(&_stackprofx.overall_signals, 1);
+	if (_stackprofx.external_in_gc) {
+	    __sync_fetch_and_add(&_stackprofx.during_gc, 1);
+	    __sync_fetch_and_add(&_stackprofx.overall_samples, 1);
+	    continue;
+	}
+	pthread_mutex_lock(&_stackprofx.external_lock);
+	for (i = 0, first = 1; i < _stackprofx.external_ntargets; i++) {
+	    if (external_capture(_stackprofx.external_targets[i], _stackprofx.external_ths[i], first,
+				 _stackprofx.timestamps ? monotonic_usec() : 0))
+		first = 0;
+	}
+	pthread_mutex_unlock(&_stackprofx.external_lock);
+	/* also picks up new threads when nothing was captured */
+	rb_postponed_job_register_one(0, stackprofx_external_drain, 0);
+    }
+    return NULL;
+}
+
+static int
+stackprofx_external_spawn(void)
+{
+    _stackprofx.external_stop = 0;
+    if (pthread_create(&_stackprofx.external_thread, NULL, stackprofx_external_main, NULL) != 0)
+	return 0;
+    _stackprofx.external_started = 1;
+    return 1;
+}
+
+static void
+stackprofx_external_start(void)
+{
+    if (!_stackprofx.external_ring)
+	_stackprofx.external_ring = ALLOC_N(external_slot_t, EXTERNAL_SLOTS);
+    _stackprofx.external_head = _stackprofx.external_tail = 0;
+    _stackprofx.external_samples = 0;
+    _stackprofx.external_torn = 0;
+    _stackprofx.external_invalid = 0;
+    _stackprofx.external_dropped = 0;
+    stackprofx_external_targets();
+
+    if (!_stackprofx.external_iseqs)
+	_stackprofx.external_iseqs = st_init_numtable();
+    rb_objspace_each_objects(external_heap_i, 0);
+    if (!exttracer)
+	exttracer = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_FREEOBJ, external_iseq_freeobj, 0);
+    rb_tracepoint_enable(exttracer);
+    if (!gctracer)
+	gctracer = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_GC_START | RUBY_INTERNAL_EVENT_GC_END_MARK,
+				     external_gc_event, 0);
+    _stackprofx.external_in_gc = 0;
+    rb_tracepoint_enable(gctracer);
+
+    if (!stackprofx_external_spawn()) {
+	rb_tracepoint_disable(gctracer);
+	_stackprofx.running = 0;
+	rb_sys_fail("pthread_create");
+    }
+}
+
+static void
+stackprofx_external_stop(void)
+{
+    if (_stackprofx.external_started) {
+	_stackprofx.external_stop = 1;
+	pthread_join(_stackprofx.external_thread, NULL);
+	_stackprofx.external_started = 0;
+    }
+    _stackprofx.external_restart = 0;
+    _stackprofx.external_ntargets = 0;
+    if (gctracer)
+	rb_tracepoint_disable(gctracer);
+
+    /* captures still in the ring are dropped by the drain once stopped */
+    if (_stackprofx.external_iseqs) {
+	rb_tracepoint_disable(exttracer);
+	st_free_table(_stackprofx.external_iseqs);
+	_stackprofx.external_iseqs = NULL;
+    }
 }
 
 static void
@@ -538,18 +4725,71 @@ static int
 frame_mark_i(st_data_t key, st_data_t val, st_data_t arg)
 {
     VALUE frame = (VALUE)key;
-    rb_gc_mark(frame);
+    if (FRAME_CFUNC_P(frame))
+	rb_gc_mark(FRAME_CFUNC(frame)->klass);
+    else if (!FRAME_NATIVE_P(frame))
+	rb_gc_mark(frame);
+    return ST_CONTINUE;
+}
+
+static int
+fiber_counts_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    fiber_count_t *fc = (fiber_count_t *)val;
+
+    rb_gc_mark((VALUE)key);
+    rb_gc_mark(fc->thread);
+    if (fc->frames)
+	st_foreach(fc->frames, frame_mark_i, 0);
+    return ST_CONTINUE;
+}
+
+static int
+gvl_waits_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    gvl_stack_t *stack;
+    int i;
+
+    for (stack = (gvl_stack_t *)val; stack; stack = stack->next)
+	for (i = 0; i < stack->num; i++)
+	    frame_mark_i((st_data_t)stack->frames[i], 0, 0);
     return ST_CONTINUE;
 }
 
 static void
 stackprofx_gc_mark(void *data)
 {
+    long i;
+    size_t o;
+
     if (RTEST(_stackprofx.out))
 	rb_gc_mark(_stackprofx.out);
 
     if (_stackprofx.frames)
 	st_foreach(_stackprofx.frames, frame_mark_i, 0);
+
+    if (_stackprofx.sample_threads)
+	st_foreach(_stackprofx.sample_threads, frame_mark_i, 0);
+
+    if (_stackprofx.shared_hashes)
+	st_foreach(_stackprofx.shared_hashes, frame_mark_i, 0);
+    for (o = 0; o < _stackprofx.shared_pending_len; o += 1 + _stackprofx.shared_pending[o])
+	for (i = 0; i < (long)_stackprofx.shared_pending[o]; i++)
+	    frame_mark_i((st_data_t)_stackprofx.shared_pending[o + 1 + i], 0, 0);
+
+    if (_stackprofx.fiber_counts)
+	st_foreach(_stackprofx.fiber_counts, fiber_counts_mark_i, 0);
+
+    if (_stackprofx.thread_stats)
+	st_foreach(_stackprofx.thread_stats, frame_mark_i, 0);
+
+    if (_stackprofx.gvl_waits)
+	st_foreach(_stackprofx.gvl_waits, gvl_waits_mark_i, 0);
+    for (i = 0; i < _stackprofx.external_ntargets; i++)
+	rb_gc_mark(_stackprofx.external_targets[i]);
+
+    st_foreach(frame_symbols, frame_symbols_mark_i, 0);
+    st_foreach(native_frames, native_frame_mark_i, 0);
 }
 
 static void
@@ -557,9 +4797,12 @@ stackprofx_atfork_prepare(void)
 {
     struct itimerval timer;
     if (_stackprofx.running) {
-	if (_stackprofx.mode == sym_wall || _stackprofx.mode == sym_cpu) {
+	if (_stackprofx.external) {
+	    /* the child must not inherit the target list mid-update */
+	    pthread_mutex_lock(&_stackprofx.external_lock);
+	} else if (_stackprofx.mode == sym_wall || _stackprofx.mode == sym_cpu || _stackprofx.mode == sym_gvl) {
 	    memset(&timer, 0, sizeof(timer));
-	    setitimer(_stackprofx.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	    setitimer(_stackprofx.mode == sym_cpu ? ITIMER_PROF : ITIMER_REAL, &timer, 0);
 	}
     }
 }
@@ -569,11 +4812,13 @@ stackprofx_atfork_parent(void)
 {
     struct itimerval timer;
     if (_stackprofx.running) {
-	if (_stackprofx.mode == sym_wall || _stackprofx.mode == sym_cpu) {
+	if (_stackprofx.external) {
+	    pthread_mutex_unlock(&_stackprofx.external_lock);
+	} else if (_stackprofx.mode == sym_wall || _stackprofx.mode == sym_cpu || _stackprofx.mode == sym_gvl) {
 	    timer.it_interval.tv_sec = 0;
 	    timer.it_interval.tv_usec = NUM2LONG(_stackprofx.interval);
 	    timer.it_value = timer.it_interval;
-	    setitimer(_stackprofx.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	    setitimer(_stackprofx.mode == sym_cpu ? ITIMER_PROF : ITIMER_REAL, &timer, 0);
 	}
     }
 }
@@ -581,7 +4826,60 @@ stackprofx_atfork_parent(void)
 static void
 stackprofx_atfork_child(void)
 {
-    stackprofx_stop(rb_mStackProfx);
+    /* the parent publishes the stacks it had parked */
+    _stackprofx.shared_pending_len = 0;
+    if (_stackprofx.running && _stackprofx.external) {
+	/* only the forking thread survives; the sampler thread is gone */
+	pthread_mutex_unlock(&_stackprofx.external_lock);
+	_stackprofx.external_started = 0;
+    }
+    if (!_stackprofx.running || !_stackprofx.fork_continue) {
+	stackprofx_stop(rb_mStackProfx);
+	return;
+    }
+
+    /*
+     * Forget, rather than free, the inherited tables: freeing would touch
+     * (and so copy) every page still shared with the parent.
+     */
+    _stackprofx.frames = NULL;
+    _stackprofx.overall_signals = 0;
+    _stackprofx.overall_samples = 0;
+    _stackprofx.during_gc = 0;
+    _stackprofx.sample_ticks = 0;
+    _stackprofx.sampling_ns = 0;
+    _stackprofx.sampling_max_ns = 0;
+    _stackprofx.hot_allocations = 0;
+    _stackprofx.grow_queue_len = 0;
+    _stackprofx.housekeeping = 0;
+    _stackprofx.raw_dropped = 0;
+    MEMZERO(&_stackprofx.raw_samples, raw_store_t, 1);
+    MEMZERO(&_stackprofx.raw_timestamps, raw_store_t, 1);
+    _stackprofx.raw_sample_last = NULL;
+    _stackprofx.sample_threads = NULL;
+    _stackprofx.fiber_counts = NULL;
+    _stackprofx.thread_stats = NULL;
+    _stackprofx.gvl_waits = NULL;
+    MEMZERO(_stackprofx.gvl_states, size_t, GVL_STATES);
+    _stackprofx.gvl_waiters = 0;
+    if (_stackprofx.raw_fd >= 0) {
+	/* the file is the parent's; the child keeps its raw samples in memory */
+	close(_stackprofx.raw_fd);
+	_stackprofx.raw_fd = -1;
+    }
+    _stackprofx.fork_pending = 1;
+
+    /*
+     * Timers and threads are not inherited across fork. pthread_create is
+     * not async-signal-safe, so the sampler is spawned by the first drain.
+     */
+    if (_stackprofx.external) {
+	_stackprofx.external_head = _stackprofx.external_tail = 0;
+	_stackprofx.external_restart = 1;
+	rb_postponed_job_register_one(0, stackprofx_external_drain, 0);
+    } else {
+	stackprofx_atfork_parent();
+    }
 }
 
 void
@@ -609,8 +4907,72 @@ Init_stackprofx(void)
     S(out);
     S(frames);
     S(aggregate);
+    S(format);
+    S(hash);
+    S(pprof);
+    S(profile);
+    S(delta);
+    S(fibers);
+    S(cfunc);
+    S(native);
+    S(granularity);
+    S(external);
+    S(torn);
+    S(invalid);
+    S(cpu_time_us);
+    S(gvl);
+    S(gvl_states);
+    S(gvl_waiters);
+    S(gvl_wait_stacks);
+    S(holding);
+    S(waiting);
+    S(blocked);
+    S(sleeping);
+    S(runnable);
+    S(stopped);
+    S(stopped_forever);
+    S(killed);
+    S(method);
+    S(thread);
+    S(suspended_samples);
+    S(sample_ticks);
+    S(sampling_ns);
+    S(sampling_max_ns);
+    S(hot_allocations);
+    S(total_delta);
+    S(id);
+    S(children);
+    S(threshold);
+    S(focus);
+    S(ignore);
+    S(collapsed);
+    S(speedscope);
+    S(timestamps);
+    S(raw_file);
+    S(raw_dropped_samples);
+    S(max_memory);
+    S(memory);
+    S(dropped);
+    S(folded_frames);
+    S(exhausted);
+    S(fork);
+    S(continue);
+    S(shared);
+    S(shared_dropped);
+    S(raw_timestamp_deltas);
+    S(raw_sample_threads);
+    S(sample_threads);
 #undef S
 
+    _stackprofx.raw_fd = -1;
+
+    frame_symbols = st_init_numtable();
+    cfunc_frames = st_init_table(&cfunc_frame_type);
+    native_frames = st_init_numtable();
+    rb_global_variable(&symtracer);
+    rb_global_variable(&exttracer);
+    rb_global_variable(&gctracer);
+
     gc_hook = Data_Wrap_Struct(rb_cObject, stackprofx_gc_mark, NULL, &_stackprofx);
     rb_global_variable(&gc_hook);
 
@@ -621,6 +4983,19 @@ Init_stackprofx(void)
     rb_define_singleton_method(rb_mStackProfx, "stop", stackprofx_stop, 0);
     rb_define_singleton_method(rb_mStackProfx, "results", stackprofx_results, -1);
     rb_define_singleton_method(rb_mStackProfx, "sample", stackprofx_sample, 0);
+    rb_define_singleton_method(rb_mStackProfx, "merge", stackprofx_merge, 1);
+    rb_define_singleton_method(rb_mStackProfx, "diff", stackprofx_diff, 2);
+    rb_define_singleton_method(rb_mStackProfx, "shared_results", stackprofx_shared_results, 0);
+
+    cProfile = rb_define_class_under(rb_mStackProfx, "Profile", rb_cObject);
+    rb_undef_alloc_func(cProfile);
+    rb_define_method(cProfile, "to_h", profile_to_h_m, 0);
+    rb_define_method(cProfile, "size", profile_size, 0);
+    rb_define_method(cProfile, "frame", profile_frame, 1);
+    rb_define_method(cProfile, "top", profile_top, -1);
+    rb_define_method(cProfile, "call_tree", profile_call_tree, -1);
+    rb_define_method(cProfile, "callers", profile_callers, -1);
 
+    pthread_mutex_init(&_stackprofx.external_lock, NULL);
     pthread_atfork(stackprofx_atfork_prepare, stackprofx_atfork_parent, stackprofx_atfork_child);
 }
@@ -2,6 +2,10 @@ $:.unshift File.expand_path('../../lib', __FILE__)
 require 'stackprofx'
 require 'minitest/autorun'
 require 'tempfile'
+require 'tmpdir'
+require 'stringio'
+require 'zlib'
+require 'json'
 
 class StackProfxTest < MiniTest::Test
   def test_info
@@ -107,6 +111,82 @@ class StackProfxTest < MiniTest::Test
     assert_equal 'block (2 levels) in StackProfxTest#test_raw', profile[:frames][raw[-2]][:name]
   end
 
+  def test_frame_ids
+    profile = StackProfx.run(mode: :custom, raw: true) do
+      StackProfx.sample
+    end
+
+    frames = profile[:frames]
+    assert_equal (1..frames.size).to_a, frames.keys
+    frames.each_value do |frame|
+      (frame[:edges] || {}).each_key { |id| assert frames.key?(id) }
+    end
+    raw = profile[:raw]
+    assert_equal frames.keys.reverse, raw[1, raw[0]]
+  end
+
+  def test_raw_file
+    path = File.join(Dir.tmpdir, "stackprofx-raw-#{$$}")
+    profile = StackProfx.run(mode: :custom, raw_file: path) do
+      10.times do
+        StackProfx.sample
+      end
+    end
+
+    raw = profile[:raw]
+    assert_equal 10, raw[-1]
+    assert_equal raw[0] + 2, raw.size
+    refute File.exist?(path)
+  end
+
+  def test_max_memory
+    profile = StackProfx.run(mode: :custom, raw: true, max_memory: 1) do
+      10.times do
+        StackProfx.sample
+      end
+    end
+
+    assert_equal 10, profile[:samples]
+    assert_equal true, profile[:dropped][:lines]
+    assert_equal true, profile[:dropped][:raw]
+    assert_operator profile[:dropped][:folded_frames], :>, 0
+    assert_equal true, profile[:dropped][:exhausted]
+    assert_nil profile[:raw]
+    assert_equal ['(other)'], profile[:frames].values.map { |f| f[:name] }
+  end
+
+  def test_merge
+    profiles = 2.times.map do
+      StackProfx.run(mode: :custom, raw: true) do
+        5.times do
+          StackProfx.sample
+        end
+      end
+    end
+
+    tmpfile = Tempfile.new('stackprof-merge')
+    tmpfile.write(Marshal.dump(profiles.last))
+    tmpfile.close
+
+    merged = StackProfx.merge([profiles.first, tmpfile.path])
+    assert_equal 10, merged[:samples]
+    frame = merged[:frames].values.find { |f| f[:name] == 'block (3 levels) in StackProfxTest#test_merge' }
+    assert_equal 10, frame[:samples]
+    assert_equal [10, 10], frame[:lines][frame[:line] + 1]
+    # identical stacks from both inputs are summed into one
+    assert_equal merged[:raw][0] + 2, merged[:raw].size
+    assert_equal 10, merged[:raw][-1]
+
+    assert_raises(ArgumentError) { StackProfx.merge([profiles.first, profiles.first.merge(interval: 10)]) }
+
+    dangling = Marshal.load(Marshal.dump(profiles.first))
+    dangling[:frames].values.first[:edges] = { 0 => 1 }
+    dangling[:raw] = [1, 0, 3] + dangling[:raw]
+    merged = StackProfx.merge([dangling])
+    merged[:frames].each_value { |f| refute f.fetch(:edges, {}).key?(nil) }
+    assert_equal 5, merged[:raw][-1]
+  end
+
   def test_fork
     StackProfx.run do
       pid = fork do
@@ -118,6 +198,61 @@ class StackProfxTest < MiniTest::Test
     end
   end
 
+  def test_fork_continue
+    Dir.mktmpdir do |dir|
+      StackProfx.start(mode: :custom, fork: :continue, out: File.join(dir, 'stackprofx-%{pid}.dump'))
+      StackProfx.sample
+      pid = fork do
+        3.times do
+          StackProfx.sample
+        end
+        StackProfx.stop
+        StackProfx.results
+        exit!
+      end
+      Process.wait(pid)
+      StackProfx.stop
+      StackProfx.results
+
+      child = Marshal.load(File.binread(File.join(dir, "stackprofx-#{pid}.dump")))
+      parent = Marshal.load(File.binread(File.join(dir, "stackprofx-#{$$}.dump")))
+      assert_equal 3, child[:samples]
+      assert_equal 1, parent[:samples]
+    end
+  end
+
+  def test_shared
+    StackProfx.start(mode: :custom, shared: true)
+    StackProfx.sample
+    pid = fork do
+      2.times do
+        StackProfx.sample
+      end
+      exit!
+    end
+    Process.wait(pid)
+    profile = StackProfx.shared_results
+    StackProfx.stop
+    StackProfx.results
+
+    assert_equal 3, profile[:samples]
+    assert_equal 0, profile[:shared_dropped]
+    assert_equal 3, profile[:frames].values.map { |f| f[:samples] }.inject(:+)
+    names = profile[:frames].values.map { |f| f[:name] }
+    assert_includes names, 'block (2 levels) in StackProfxTest#test_shared'
+  end
+
+  def test_shared_teardown
+    StackProfx.run(mode: :custom, shared: true) { StackProfx.sample }
+    shared = StackProfx.shared_results
+    StackProfx.run(mode: :custom) { 3.times { StackProfx.sample } }
+
+    assert_equal 1, shared[:samples]
+    assert_equal 1, shared[:frames].values.map { |f| f[:samples] }.inject(:+)
+    # the plain session unmapped the segment instead of sampling into it
+    assert_nil StackProfx.shared_results
+  end
+
   def test_gc
     profile = StackProfx.run(interval: 100) do
       5.times do
@@ -142,6 +277,450 @@ class StackProfxTest < MiniTest::Test
     refute_empty profile[:frames]
   end
 
+  def test_pprof
+    StackProfx.start(mode: :custom, raw: true)
+    10.times do
+      StackProfx.sample
+    end
+    StackProfx.stop
+
+    data = StackProfx.results(format: :pprof)
+    proto = Zlib::GzipReader.new(StringIO.new(data)).read
+    assert_includes proto, 'block in StackProfxTest#test_pprof'
+    assert_includes proto, 'samples'
+    assert_equal nil, StackProfx.results
+
+    StackProfx.start(mode: :custom)
+    StackProfx.sample
+    StackProfx.stop
+    assert_raises(ArgumentError) { StackProfx.results(format: :pprof) }
+    StackProfx.results
+  end
+
+  def test_pprof_lines
+    StackProfx.start(mode: :custom, raw: true)
+    pprof_line_probe
+    StackProfx.stop
+    data = StackProfx.results(format: :pprof)
+    profile = proto_fields(Zlib::GzipReader.new(StringIO.new(data)).read)
+
+    strings = profile.select { |f, _| f == 6 }.map(&:last)
+    function = profile.select { |f, _| f == 5 }.map { |_, v| Hash[proto_fields(v)] }
+                      .find { |fn| strings[fn[2]] == 'StackProfxTest#pprof_line_probe' }
+    lines = profile.select { |f, _| f == 4 }.flat_map { |_, v| proto_fields(v).select { |f, _| f == 4 } }
+                   .map { |_, v| Hash[proto_fields(v)] }
+                   .select { |line| line[1] == function[1] }.map { |line| line[2] }
+    assert_includes lines, function[5] + 2
+  end
+
+  def pprof_line_probe
+    nil
+    StackProfx.sample
+  end
+
+  # [field, varint or bytes] pairs of a protobuf message
+  def proto_fields(bytes)
+    io = StringIO.new(bytes)
+    fields = []
+    until io.eof?
+      key = proto_varint(io)
+      case key & 7
+      when 0 then fields << [key >> 3, proto_varint(io)]
+      when 2 then fields << [key >> 3, io.read(proto_varint(io))]
+      else raise "unexpected wire type #{key & 7}"
+      end
+    end
+    fields
+  end
+
+  def proto_varint(io)
+    value = shift = 0
+    loop do
+      byte = io.readbyte
+      value |= (byte & 0x7f) << shift
+      shift += 7
+      return value if byte < 0x80
+    end
+  end
+
+  def test_collapsed
+    StackProfx.start(mode: :custom, raw: true)
+    10.times do
+      StackProfx.sample
+    end
+    StackProfx.stop
+
+    folded = StackProfx.results(format: :collapsed)
+    lines = folded.lines
+    assert_equal 1, lines.size
+    assert_match(/;block \(2 levels\) in StackProfxTest#test_collapsed 10$/, lines.first)
+  end
+
+  def test_collapsed_separator
+    # cfunc frames are labelled with the name they were called by
+    StackProfx.singleton_class.send(:alias_method, :"sample;probe", :sample)
+    StackProfx.start(mode: :custom, raw: true, cfunc: true)
+    StackProfx.send(:"sample;probe")
+    StackProfx.stop
+
+    stack, _, count = StackProfx.results(format: :collapsed).lines.first.chomp.rpartition(' ')
+    assert_equal '1', count
+    assert_equal 'StackProfx.sample:probe', stack.split(';').last
+  ensure
+    StackProfx.singleton_class.send(:remove_method, :"sample;probe")
+  end
+
+  def test_timestamps
+    profile = StackProfx.run(mode: :custom, timestamps: true) do
+      10.times do
+        StackProfx.sample
+      end
+    end
+
+    assert_equal 10, profile[:raw][-1]
+    assert_equal 10, profile[:raw_timestamp_deltas].size
+    assert_equal [0] * 10, profile[:raw_sample_threads]
+    assert_equal [Thread.current.object_id], profile[:sample_threads]
+  end
+
+  def test_speedscope
+    StackProfx.start(mode: :custom, timestamps: true)
+    sleep 0.01
+    10.times do
+      StackProfx.sample
+    end
+    StackProfx.stop
+
+    data = JSON.parse(StackProfx.results(format: :speedscope))
+    names = data['shared']['frames'].map { |f| f['name'] }
+    assert_includes names, 'block in StackProfxTest#test_speedscope'
+
+    thread = data['profiles'].first
+    assert_equal 'sampled', thread['type']
+    assert_equal 10, thread['samples'].size
+    assert_equal 10, thread['weights'].size
+    assert_operator thread['startValue'], :>=, 10_000
+    assert_operator thread['endValue'], :>, thread['startValue']
+  end
+
+  def test_profile_object
+    StackProfx.start(mode: :custom)
+    10.times do
+      StackProfx.sample
+    end
+    StackProfx.stop
+
+    profile = StackProfx.results(format: :profile)
+    assert_instance_of StackProfx::Profile, profile
+    assert_nil StackProfx.results
+
+    top = profile.top(3)
+    assert_equal 3, top.size
+    counts = top.map { |_, frame| frame[:samples] }
+    assert_equal counts.sort.reverse, counts
+    id, frame = top.first
+    assert_equal frame, profile.frame(id)
+    assert_equal profile.size, profile.to_h[:frames].size
+    assert_equal 10, profile.to_h[:samples]
+  end
+
+  def test_symbol_cache
+    file = "symbol_cache_#{object_id}.rb"
+    obj = Object.new
+    obj.instance_eval("def probe; StackProfx.sample; end", file)
+    names = 2.times.map do
+      profile = StackProfx.run(mode: :custom) { obj.probe }
+      profile[:frames].values.find { |f| f[:name].end_with?('probe') }[:name]
+    end
+
+    assert names[0].frozen?
+    assert names[0].equal?(names[1])
+    refute file.frozen?
+  end
+
+  def test_symbol_cache_eviction
+    anchor = Object.new
+    names = ObjectSpace::WeakMap.new
+    symbol_cache_doomed(anchor, names)
+    5.times { GC.start }
+    assert_nil names[anchor]
+  end
+
+  # the method, its iseq and the cached name are unreachable on return
+  def symbol_cache_doomed(anchor, names)
+    mod = Module.new
+    mod.module_eval("def self.doomed; StackProfx.sample; end", "doomed_#{object_id}.rb")
+    profile = StackProfx.run(mode: :custom) { mod.doomed }
+    names[anchor] = profile[:frames].values.find { |f| f[:name].end_with?('doomed') }[:name]
+    nil
+  end
+
+  def test_call_tree
+    StackProfx.start(mode: :custom, raw: true)
+    3.times { tree_a }
+    tree_b
+    StackProfx.stop
+    profile = StackProfx.results(format: :profile)
+
+    ids = profile.to_h[:frames].map { |id, f| [f[:name], id] }.to_h
+    a, b = ids['StackProfxTest#tree_a'], ids['StackProfxTest#tree_b']
+
+    tree = profile.call_tree
+    assert_equal 4, tree[:total_samples]
+
+    sub = profile.call_tree(a)
+    assert_equal a, sub[:id]
+    assert_equal 3, sub[:total_samples]
+    assert_equal 3, sub[:children].first[:samples]
+
+    callers = profile.callers(a)
+    assert_equal 3, callers[:samples]
+    assert_equal ids['block in StackProfxTest#test_call_tree'], callers[:children].first[:id]
+
+    assert_equal 1, profile.call_tree(focus: b)[:total_samples]
+    assert_equal 3, profile.call_tree(ignore: b)[:total_samples]
+    test = ids['StackProfxTest#test_call_tree']
+    assert_equal 2, profile.call_tree(test)[:children].size
+    assert_equal 1, profile.call_tree(test, threshold: 0.5)[:children].size
+
+    StackProfx.start(mode: :custom)
+    StackProfx.sample
+    StackProfx.stop
+    assert_raises(RuntimeError) do
+      StackProfx.results(format: :profile).call_tree
+    end
+  end
+
+  def tree_a
+    StackProfx.sample
+  end
+
+  def tree_b
+    StackProfx.sample
+  end
+
+  def test_diff
+    before = StackProfx.run(mode: :custom) do
+      2.times { tree_a }
+      2.times { tree_b }
+    end
+    after = StackProfx.run(mode: :custom) do
+      tree_a
+      3.times { tree_b }
+    end
+
+    diff = StackProfx.diff(before, after)
+    assert_equal [4, 4], diff[:samples]
+
+    a = diff[:frames].find { |f| f[:name] == 'StackProfxTest#tree_a' }
+    b = diff[:frames].find { |f| f[:name] == 'StackProfxTest#tree_b' }
+    assert_equal [2, 1], a[:samples]
+    assert_in_delta(-0.25, a[:delta])
+    assert_in_delta 0.25, b[:delta]
+    assert_operator diff[:frames].first[:delta].abs, :>=, diff[:frames].last[:delta].abs
+
+    line = diff[:lines].find { |l| l[:name] == 'StackProfxTest#tree_b' }
+    assert_in_delta 0.25, line[:delta]
+  end
+
+  def test_sampling_cost
+    profile = StackProfx.run(mode: :custom) do
+      3.times { StackProfx.sample }
+    end
+
+    assert_equal 3, profile[:sample_ticks]
+    assert_operator profile[:sampling_ns], :>, 0
+    assert_operator profile[:sampling_max_ns], :<=, profile[:sampling_ns]
+  end
+
+  def test_external
+    assert_raises(ArgumentError) { StackProfx.start(mode: :cpu, external: true) }
+
+    profile = StackProfx.run(mode: :wall, external: true, interval: 500) do
+      deadline = Time.now + 0.2
+      math while Time.now < deadline
+    end
+
+    assert_operator profile[:external][:samples], :>, 0
+    assert_includes profile[:frames].values.map { |f| f[:name] }, "StackProfxTest#math"
+  end
+
+  def test_external_gc
+    profile = StackProfx.run(mode: :wall, external: true, interval: 500) do
+      deadline = Time.now + 0.2
+      GC.start while Time.now < deadline
+    end
+
+    assert_operator profile[:gc_samples], :>, 0
+  end
+
+  def test_external_fork_continue
+    Dir.mktmpdir do |dir|
+      StackProfx.start(mode: :wall, external: true, interval: 500, fork: :continue,
+                       out: File.join(dir, 'stackprofx-%{pid}.dump'))
+      pid = fork do
+        deadline = Time.now + 0.2
+        math while Time.now < deadline
+        StackProfx.stop
+        StackProfx.results
+        exit!
+      end
+      Process.wait(pid)
+      StackProfx.stop
+      StackProfx.results
+
+      child = Marshal.load(File.binread(File.join(dir, "stackprofx-#{pid}.dump")))
+      assert_operator child[:external][:samples], :>, 0
+    end
+  end
+
+  def test_thread_stats
+    sleeper = Thread.new { sleep }
+    Thread.pass until sleeper.status == 'sleep'
+    profile = StackProfx.run(mode: :custom) do
+      3.times { StackProfx.sample }
+    end
+    sleeper.kill.join
+
+    current = profile[:threads][Thread.current.object_id]
+    assert_equal 3, current[:samples][:runnable]
+    assert_kind_of Integer, current[:cpu_time_us]
+    assert_equal 3, profile[:threads][sleeper.object_id][:samples][:stopped_forever]
+  end
+
+  def test_gvl
+    stop = false
+    spinner = Thread.new { math until stop }
+    sleeper = Thread.new { sleep }
+    profile = StackProfx.run(mode: :gvl, interval: 1000) do
+      deadline = Time.now + 0.5
+      math while Time.now < deadline
+    end
+    stop = true
+    spinner.join
+    sleeper.kill.join
+
+    assert_equal :gvl, profile[:mode]
+    assert_operator profile[:gvl_states][:holding], :>, 0
+    assert_operator profile[:gvl_states][:waiting], :>, 0
+    assert_operator profile[:gvl_states][:sleeping], :>, 0
+
+    stack = profile[:gvl_wait_stacks].first
+    assert_operator stack[:samples], :>, 0
+    names = stack[:frames].map { |id| profile[:frames][id][:name] }
+    assert_includes names, "StackProfxTest#math"
+  end
+
+  def test_hot_allocations
+    once = StackProfx.run(mode: :custom, raw: true, timestamps: true) do
+      1.times { StackProfx.sample }
+    end
+    again = StackProfx.run(mode: :custom, raw: true, timestamps: true) do
+      10.times { StackProfx.sample }
+    end
+
+    # new frames, edges and lines allocate st entries; repeats allocate nothing
+    assert_operator once[:hot_allocations], :>, 0
+    assert_equal once[:hot_allocations], again[:hot_allocations]
+  end
+
+  def test_fibers
+    running = nil
+    profile = StackProfx.run(mode: :custom, fibers: true) do
+      running = Fiber.new { StackProfx.sample }
+      running.resume
+    end
+    assert_equal 1, profile[:fibers][running.object_id][:samples]
+    assert_equal Thread.current.object_id, profile[:fibers][running.object_id][:thread]
+
+    parked = Fiber.new { fiber_park }
+    parked.resume
+    profile = StackProfx.run(mode: :wall, fibers: true) { math }
+    parked_stats = profile[:fibers][parked.object_id]
+    assert_operator parked_stats[:suspended_samples], :>, 0
+    park_id, park = parked_stats[:frames].find { |id, _| profile[:frames][id][:name] == 'StackProfxTest#fiber_park' }
+    assert park_id
+    assert_equal parked_stats[:suspended_samples], park[:total_samples]
+    assert_equal 0, profile[:frames][park_id][:total_samples]
+
+    top = profile[:frames].values.map { |f| f[:samples] }.inject(0, :+)
+    assert_operator top, :<=, profile[:samples]
+    parked.resume
+  end
+
+  def fiber_park
+    Fiber.yield
+  end
+
+  def test_cfunc
+    profile = StackProfx.run(mode: :custom, cfunc: true, raw: true) do
+      [1].each { StackProfx.sample }
+    end
+
+    frames = profile[:frames]
+    sample = frames.find { |_, f| f[:name] == 'StackProfx.sample' }
+    each = frames.find { |_, f| f[:name] == 'Array#each' }
+    assert sample && each
+    assert_equal true, sample[1][:cfunc]
+    assert_equal 1, sample[1][:samples]
+    assert_equal sample[0], profile[:raw][profile[:raw][0]]
+
+    block = frames.find { |_, f| f[:name] == 'block in StackProfxTest#test_cfunc' }
+    assert_equal({ sample[0] => 1 }, block[1][:edges])
+    assert_equal({ block[0] => 1 }, each[1][:edges])
+  end
+
+  def test_native
+    skip 'native stacks need linux' unless RUBY_PLATFORM =~ /(x86_64|aarch64)-linux/
+    assert_raises(ArgumentError) { StackProfx.start(mode: :custom, native: true) }
+
+    data = Random.new(1).bytes(1 << 20)
+    profile = StackProfx.run(mode: :cpu, native: true, interval: 500) do
+      deadline = Time.now + 0.5
+      Zlib::Deflate.deflate(data) while Time.now < deadline
+    end
+
+    native = profile[:frames].select { |_, f| f[:native] }
+    refute_empty native
+    assert native.values.all? { |f| f[:name].is_a?(String) && f[:file].is_a?(String) }
+
+    # the walk hangs native frames below the ruby frame that called into C
+    callers = profile[:frames].values.reject { |f| f[:native] }
+    assert callers.any? { |f| f[:edges] && (f[:edges].keys & native.keys).any? }
+  end
+
+  def test_method_granularity
+    profile = StackProfx.run(mode: :custom, granularity: :method) do
+      2.times { tree_a }
+    end
+
+    assert_equal :method, profile[:granularity]
+    frame = profile[:frames].values.find { |f| f[:name] == 'StackProfxTest#tree_a' }
+    assert_equal 2, frame[:samples]
+    assert_equal 2, frame[:total_samples]
+    id = profile[:frames].key(frame)
+    caller = profile[:frames].values.find { |f| f[:name] == 'block in StackProfxTest#test_method_granularity' }
+    assert_equal 2, caller[:edges][id]
+    profile[:frames].each_value do |f|
+      assert_nil f[:lines]
+    end
+
+    assert_raises(ArgumentError) { StackProfx.start(granularity: :instruction) }
+  end
+
+  def test_record_variants
+    [true, false].product([true, false], [:line, :method]) do |raw, aggregate, granularity|
+      profile = StackProfx.run(mode: :custom, raw: raw, aggregate: aggregate, granularity: granularity) do
+        2.times { tree_a }
+      end
+
+      frame = profile[:frames].values.find { |f| f[:name] == 'StackProfxTest#tree_a' }
+      assert_equal 2, frame[:samples]
+      assert_equal !!(aggregate && granularity == :line), frame.key?(:lines)
+      assert_equal raw, profile.key?(:raw)
+    end
+  end
+
   def math
     250_000.times do
       2 ** 10